@@ -5,17 +5,175 @@
 #include <zstd.h>
 #include <zlib.h>
 
+#include <glib/gstdio.h>
+
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <linux/memfd.h>
+#include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include "notekit_external.h"
+#include "nklatex_statistics.h"
 #include "nkl_res.h"
 
 #include "config.h"
 
+#if HAVE_SYSPROF
+#include <sysprof-capture.h>
+#endif
+
 // this should be in sys/mman.h, but for some reason isn't.
 extern int memfd_create(const char *__name, unsigned int __flags);
+// same for these, they're hidden behind _GNU_SOURCE in fcntl.h
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+/* Render instrumentation.
+ *
+ * Every stage of rendering and exporting is timed as a span. Spans are
+ * logged with g_debug (G_MESSAGES_DEBUG=all), marked for Sysprof when built
+ * with it and aggregated into the Statistics interface exported next to
+ * External.
+ */
+typedef enum {
+	NK_PHASE_DOCUMENT,
+	NK_PHASE_ENGINE,
+	NK_PHASE_DVISVGM,
+	NK_PHASE_PARSE,
+	NK_PHASE_RENDER,
+	NK_PHASE_OPTIMIZE,
+	NK_PHASE_COMPRESS,
+	NK_PHASE_EXPORT,
+	NK_PHASE_ENCODE,
+	NK_N_PHASES
+} NkPhase;
+static const gchar* const nk_phase_names[NK_N_PHASES] = {
+	"document", "engine", "dvisvgm", "parse", "render", "optimize", "compress", "export", "encode"
+};
+
+typedef enum {
+	NK_COUNTER_RENDERS,
+	NK_COUNTER_CACHE_HITS,
+	NK_COUNTER_COMPILES,
+	NK_COUNTER_FAILURES,
+	NK_COUNTER_EXPORTS,
+	NK_N_COUNTERS
+} NkCounter;
+static const gchar* const nk_counter_names[NK_N_COUNTERS] = {
+	"renders", "cache-hits", "compiles", "failures", "exports"
+};
+
+// bucket 0 is < 1ms, bucket i < 2^i ms, the last one everything above
+#define NK_STATS_BUCKETS 14
+
+typedef struct NkPhaseStats {
+	guint64 count;
+	guint64 total;
+	guint64 buckets[NK_STATS_BUCKETS];
+} NkPhaseStats;
+
+typedef struct NkStats {
+	NkPhaseStats phases[NK_N_PHASES];
+	guint64 counters[NK_N_COUNTERS];
+	NkLatexStatistics* iface;
+	guint publish_source;
+} NkStats;
+
+// spans also end on worker threads
+G_LOCK_DEFINE_STATIC(nk_stats);
+static NkStats nk_stats;
+
+static gboolean nk_stats_publish(gpointer) {
+	GVariantBuilder counters, phases;
+	g_variant_builder_init(&counters, G_VARIANT_TYPE("a{st}"));
+	g_variant_builder_init(&phases, G_VARIANT_TYPE("a{s(ttat)}"));
+
+	G_LOCK(nk_stats);
+	nk_stats.publish_source = 0;
+	for (guint i = 0; i < NK_N_COUNTERS; i++)
+		g_variant_builder_add(&counters, "{st}", nk_counter_names[i], nk_stats.counters[i]);
+	for (guint i = 0; i < NK_N_PHASES; i++) {
+		NkPhaseStats* phase = &nk_stats.phases[i];
+		GVariant* buckets = g_variant_new_fixed_array(G_VARIANT_TYPE_UINT64, phase->buckets, NK_STATS_BUCKETS, sizeof(guint64));
+		g_variant_builder_add(&phases, "{s(tt@at)}", nk_phase_names[i], phase->count, phase->total, buckets);
+	}
+	NkLatexStatistics* iface = nk_stats.iface;
+	G_UNLOCK(nk_stats);
+
+	if (iface) {
+		nk_latex_statistics_set_counters(iface, g_variant_builder_end(&counters));
+		nk_latex_statistics_set_phases(iface, g_variant_builder_end(&phases));
+	} else {
+		g_variant_builder_clear(&counters);
+		g_variant_builder_clear(&phases);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+// with nk_stats held
+static void nk_stats_changed(void) {
+	if (nk_stats.iface && !nk_stats.publish_source)
+		nk_stats.publish_source = g_idle_add(nk_stats_publish, NULL);
+}
+
+/* Starts publishing to iface, or stops if it's NULL. */
+void nk_stats_attach(NkLatexStatistics* iface) {
+	G_LOCK(nk_stats);
+	nk_stats.iface = iface;
+	if (!iface && nk_stats.publish_source) {
+		g_source_remove(nk_stats.publish_source);
+		nk_stats.publish_source = 0;
+	}
+	G_UNLOCK(nk_stats);
+
+	if (iface)
+		nk_stats_publish(NULL);
+}
+
+void nk_stats_count(NkCounter counter) {
+	G_LOCK(nk_stats);
+	nk_stats.counters[counter]++;
+	nk_stats_changed();
+	G_UNLOCK(nk_stats);
+}
+
+/* Accounts a span of phase between the g_get_monotonic_time() stamps begin
+ * and end. */
+void nk_stats_span(NkPhase phase, gint64 begin, gint64 end, const gchar* detail) {
+	gint64 duration = end - begin;
+	g_debug("%s took %.3f ms%s%s\n", nk_phase_names[phase], duration / 1000.0, detail ? ": " : "", detail ? detail : "");
+#if HAVE_SYSPROF
+	// same clock, in ns
+	sysprof_collector_mark(begin * 1000, duration * 1000, "NkLaTeX", nk_phase_names[phase], detail);
+#endif
+
+	guint bucket = 0;
+	for (gint64 ms = duration / 1000; ms && bucket < NK_STATS_BUCKETS-1; ms >>= 1)
+		bucket++;
+
+	G_LOCK(nk_stats);
+	NkPhaseStats* stats = &nk_stats.phases[phase];
+	stats->count++;
+	stats->total += duration;
+	stats->buckets[bucket]++;
+	nk_stats_changed();
+	G_UNLOCK(nk_stats);
+}
+
+typedef struct NkRenderScheduler NkRenderScheduler;
+NkRenderScheduler* nk_render_scheduler_new(void);
+void nk_render_scheduler_free(NkRenderScheduler* self);
 
 enum {
 	SIGNAL_EACTIVATE,
@@ -27,6 +185,8 @@ typedef struct {
 	GDBusObjectManagerServer* bus_mgr;
 	NoteKitObjectSkeleton* skel;
 	NoteKitExternal* ext;
+	NkLatexStatistics* stats;
+	NkRenderScheduler* scheduler;
 } NkExtApplPrivate;
 
 struct _NkExtApplClass {
@@ -40,7 +200,7 @@ G_DECLARE_DERIVABLE_TYPE(NkExtAppl, nk_ext_appl, NOTEKIT, APPLICATION, AdwApplic
 G_DEFINE_TYPE_WITH_PRIVATE(NkExtAppl, nk_ext_appl, ADW_TYPE_APPLICATION)
 
 static bool nk_ext_appl_eactivate(NoteKitExternal* nke, GDBusMethodInvocation* invoc, GVariant* widget, const gchar* path, gpointer user_data) {
-	GVariant* copath = g_variant_new("s", g_strdup(path));
+	GVariant* copath = g_variant_new("s", path);
 	g_signal_emit(user_data, nk_ext_appl_signals[SIGNAL_EACTIVATE], 0, g_variant_ref(widget), copath);
 	note_kit_external_complete_activate(nke, invoc);
 	return TRUE;
@@ -59,6 +219,10 @@ static gboolean nk_ext_appl_dbus_register(GApplication* app, GDBusConnection* co
 	priv->ext = note_kit_external_skeleton_new();
 	note_kit_object_skeleton_set_external(priv->skel, priv->ext);
 
+	priv->stats = nk_latex_statistics_skeleton_new();
+	g_dbus_object_skeleton_add_interface(G_DBUS_OBJECT_SKELETON(priv->skel), G_DBUS_INTERFACE_SKELETON(priv->stats));
+	nk_stats_attach(priv->stats);
+
 	g_dbus_object_manager_server_export(priv->bus_mgr, G_DBUS_OBJECT_SKELETON(priv->skel));
 
 	g_dbus_object_manager_server_set_connection(priv->bus_mgr, con);
@@ -73,6 +237,8 @@ static void nk_ext_appl_dbus_unregister(GApplication* app, GDBusConnection* con,
 	NkExtAppl* self = NOTEKIT_APPLICATION(app);
 	NkExtApplPrivate* priv = nk_ext_appl_get_instance_private(self);
 
+	nk_stats_attach(NULL);
+	g_clear_object(&priv->stats);
 	g_clear_object(&priv->ext);
 	g_clear_object(&priv->skel);
 	g_clear_object(&priv->bus_mgr);
@@ -81,8 +247,27 @@ static void nk_ext_appl_dbus_unregister(GApplication* app, GDBusConnection* con,
 }
 
 
-static void nk_ext_appl_init(NkExtAppl*) {}
+NkRenderScheduler* nk_ext_appl_get_scheduler(NkExtAppl* self) {
+	NkExtApplPrivate* priv = nk_ext_appl_get_instance_private(self);
+	return priv->scheduler;
+}
+
+static void nk_ext_appl_finalize(GObject* object) {
+	NkExtApplPrivate* priv = nk_ext_appl_get_instance_private(NOTEKIT_APPLICATION(object));
+
+	nk_render_scheduler_free(priv->scheduler);
+
+	G_OBJECT_CLASS(nk_ext_appl_parent_class)->finalize(object);
+}
+
+static void nk_ext_appl_init(NkExtAppl* self) {
+	NkExtApplPrivate* priv = nk_ext_appl_get_instance_private(self);
+	priv->scheduler = nk_render_scheduler_new();
+}
 static void nk_ext_appl_class_init(NkExtApplClass* class) {
+	GObjectClass* object_class = G_OBJECT_CLASS(class);
+	object_class->finalize = nk_ext_appl_finalize;
+
 	GApplicationClass* application_class = G_APPLICATION_CLASS(class);
 	application_class->dbus_register = nk_ext_appl_dbus_register;
 	application_class->dbus_unregister = nk_ext_appl_dbus_unregister;
@@ -94,8 +279,89 @@ AdwApplication* nk_ext_appl_new(void) {
 	return g_object_new(NOTEKIT_TYPE_APPLICATION, "application-id", "arpa.sp1rit.NoteKit.NkLaTeX", NULL);
 }
 
+/* librsvg handles must not be used from two threads at once, and the render
+ * cache shares them between windows, so every use that may happen off the main
+ * thread is serialized on this. */
+G_LOCK_DEFINE_STATIC(nk_rsvg);
+
+// lays handle out on ctx the way NkLatexSvgArea does at width x height
+static void nk_latex_svg_paint(RsvgHandle* handle, const RsvgRectangle* geometry, int width, int height, cairo_t* ctx) {
+	RsvgRectangle rect = *geometry;
+	rect.width = width-2*rect.x;
+	rect.height = height-2*rect.y;
+	G_LOCK(nk_rsvg);
+	rsvg_handle_render_document(handle, ctx, &rect, NULL);
+	G_UNLOCK(nk_rsvg);
+}
+
+// takes surface
+static GdkTexture* nk_texture_new_for_surface(cairo_surface_t* surface) {
+	cairo_surface_flush(surface);
+
+	int width = cairo_image_surface_get_width(surface);
+	int height = cairo_image_surface_get_height(surface);
+	int stride = cairo_image_surface_get_stride(surface);
+	GBytes* data = g_bytes_new_with_free_func(cairo_image_surface_get_data(surface), (gsize)stride * height, (GDestroyNotify)cairo_surface_destroy, surface);
+	// cairo's ARGB32 is premultiplied native endian, which GDK_MEMORY_DEFAULT matches
+	GdkTexture* texture = gdk_memory_texture_new(width, height, GDK_MEMORY_DEFAULT, data, stride);
+	g_bytes_unref(data);
+	return texture;
+}
+
+/* Rasterizes handle for a widget of width x height at the given scale, laid
+ * out the way NkLatexSvgArea draws it. Safe to call from any thread. */
+GdkTexture* nk_latex_svg_rasterize(RsvgHandle* handle, const RsvgRectangle* geometry, int width, int height, int scale) {
+	cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width * scale, height * scale);
+	cairo_t* ctx = cairo_create(surface);
+	cairo_scale(ctx, scale, scale);
+	nk_latex_svg_paint(handle, geometry, width, height, ctx);
+	cairo_destroy(ctx);
+	return nk_texture_new_for_surface(surface);
+}
+
+#define NK_SVG_TILE 256
+
+/* Rasterizes one NK_SVG_TILE square tile, in device pixels, of the same
+ * layout magnified by zoom. Safe to call from any thread. */
+GdkTexture* nk_latex_svg_rasterize_tile(RsvgHandle* handle, const RsvgRectangle* geometry, int width, int height, double zoom, int scale, int tx, int ty) {
+	cairo_surface_t* surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, NK_SVG_TILE, NK_SVG_TILE);
+	cairo_t* ctx = cairo_create(surface);
+	cairo_translate(ctx, -tx * NK_SVG_TILE, -ty * NK_SVG_TILE);
+	cairo_scale(ctx, zoom * scale, zoom * scale);
+	nk_latex_svg_paint(handle, geometry, width, height, ctx);
+	cairo_destroy(ctx);
+	return nk_texture_new_for_surface(surface);
+}
+
 typedef struct {
 	RsvgHandle** svg;
+
+	// the handle the cached state below belongs to
+	RsvgHandle* handle;
+	RsvgRectangle geometry;
+
+	GdkTexture* texture;
+	int tex_width, tex_height, tex_scale;
+	// texture still shows the previous handle, until this one is rasterized
+	gboolean tex_stale;
+	GCancellable* raster;
+	int raster_width, raster_height, raster_scale;
+
+	// magnification over the fitted size and where its origin is drawn
+	double zoom;
+	double pan_x, pan_y;
+	// gesture and pointer state
+	double zoom_begin;
+	double pan_begin_x, pan_begin_y;
+	double pointer_x, pointer_y;
+
+	// tiles of the current level, keyed by nk_latex_svg_area_tile_key
+	GHashTable* tiles;
+	GHashTable* tiles_pending;
+	GCancellable* tiles_raster;
+	guint tiles_generation;
+	int tile_level;
+	int tile_width, tile_height, tile_scale;
 } NkLatexSvgAreaPrivate;
 
 struct _NkLatexSvgAreaClass {
@@ -108,26 +374,284 @@ struct _NkLatexSvgAreaClass {
 G_DECLARE_DERIVABLE_TYPE(NkLatexSvgArea, nk_latex_svg_area, NK_LATEX, SVG_AREA, GtkWidget)
 G_DEFINE_TYPE_WITH_PRIVATE(NkLatexSvgArea, nk_latex_svg_area, GTK_TYPE_WIDGET)
 
+static void nk_latex_svg_area_cancel_raster(NkLatexSvgAreaPrivate* priv) {
+	if (priv->raster) {
+		g_cancellable_cancel(priv->raster);
+		g_clear_object(&priv->raster);
+	}
+}
+
+/* Zoomed in, the visible part is drawn from NK_SVG_TILE sized tiles rendered
+ * in the background and kept until the layout changes. Tiles are rendered
+ * at zoom levels in quarter steps of a power of two and scaled slightly to
+ * the actual zoom, so a pinch doesn't throw them away on every frame. Until
+ * a tile is ready, the fitted texture stretched underneath stands in. */
+#define NK_SVG_ZOOM_MAX 32.0
+#define NK_SVG_ZOOM_STEPS 4
+// drop invisible tiles once there are more than this, 64 MiB at 256px
+#define NK_SVG_TILE_CACHE 256
+
+static guint64 nk_latex_svg_area_tile_key(int tx, int ty) {
+	return ((guint64)(guint32)tx << 32) | (guint32)ty;
+}
+
+static void nk_latex_svg_area_clear_tiles(NkLatexSvgAreaPrivate* priv) {
+	if (priv->tiles_raster) {
+		g_cancellable_cancel(priv->tiles_raster);
+		g_clear_object(&priv->tiles_raster);
+	}
+	g_hash_table_remove_all(priv->tiles);
+	g_hash_table_remove_all(priv->tiles_pending);
+	priv->tiles_generation++;
+}
+
+/* Picks up a new handle: caches its intrinsic geometry and marks the texture
+ * stale, it stands in until the new one is ready. Holding a reference to the
+ * handle makes the pointer comparison reliable. */
+static void nk_latex_svg_area_sync(NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+
+	if (*priv->svg == priv->handle)
+		return;
+
+	g_set_object(&priv->handle, *priv->svg);
+	G_LOCK(nk_rsvg);
+	rsvg_handle_get_intrinsic_dimensions(priv->handle, NULL, NULL, NULL, NULL, NULL, &priv->geometry);
+	G_UNLOCK(nk_rsvg);
+
+	nk_latex_svg_area_cancel_raster(priv);
+	priv->tex_stale = TRUE;
+	nk_latex_svg_area_clear_tiles(priv);
+}
+
+// keeps the magnified content covering the whole widget
+static void nk_latex_svg_area_clamp(NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	int width = gtk_widget_get_width(GTK_WIDGET(self));
+	int height = gtk_widget_get_height(GTK_WIDGET(self));
+
+	priv->zoom = CLAMP(priv->zoom, 1.0, NK_SVG_ZOOM_MAX);
+	priv->pan_x = CLAMP(priv->pan_x, width - width * priv->zoom, 0.0);
+	priv->pan_y = CLAMP(priv->pan_y, height - height * priv->zoom, 0.0);
+}
+
+/* Sets the zoom, keeping the content under the widget point (x, y) in place. */
+void nk_latex_svg_area_zoom_at(NkLatexSvgArea* self, double zoom, double x, double y) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	zoom = CLAMP(zoom, 1.0, NK_SVG_ZOOM_MAX);
+
+	priv->pan_x = x - (x - priv->pan_x) * zoom / priv->zoom;
+	priv->pan_y = y - (y - priv->pan_y) * zoom / priv->zoom;
+	priv->zoom = zoom;
+	nk_latex_svg_area_clamp(self);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+static void nk_latex_svg_area_pan_by(NkLatexSvgArea* self, double dx, double dy) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	priv->pan_x += dx;
+	priv->pan_y += dy;
+	nk_latex_svg_area_clamp(self);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+typedef struct SvgAreaRasterData {
+	RsvgHandle* handle;
+	RsvgRectangle geometry;
+	int width, height, scale;
+} SvgAreaRasterData;
+static void svg_area_raster_data_free(SvgAreaRasterData* data) {
+	g_object_unref(data->handle);
+	g_free(data);
+}
+
+static void nk_latex_svg_area_raster_thread(GTask* task, gpointer, SvgAreaRasterData* data, GCancellable*) {
+	// superseded while queued, don't bother
+	if (g_task_return_error_if_cancelled(task))
+		return;
+	g_task_return_pointer(task, nk_latex_svg_rasterize(data->handle, &data->geometry, data->width, data->height, data->scale), g_object_unref);
+}
+
+static void nk_latex_svg_area_raster_cb(GObject* src, GAsyncResult* res, gpointer) {
+	NkLatexSvgArea* self = NK_LATEX_SVG_AREA(src);
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	SvgAreaRasterData* data = g_task_get_task_data(G_TASK(res));
+
+	GdkTexture* texture = g_task_propagate_pointer(G_TASK(res), NULL);
+	if (!texture)
+		return;
+	if (data->handle != priv->handle) {
+		g_object_unref(texture);
+		return;
+	}
+
+	g_clear_object(&priv->texture);
+	priv->texture = texture;
+	priv->tex_width = data->width;
+	priv->tex_height = data->height;
+	priv->tex_scale = data->scale;
+	priv->tex_stale = FALSE;
+	if (priv->raster && g_task_get_cancellable(G_TASK(res)) == priv->raster)
+		g_clear_object(&priv->raster);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+typedef struct SvgAreaTileData {
+	RsvgHandle* handle;
+	RsvgRectangle geometry;
+	int width, height, scale;
+	double zoom;
+	int tx, ty;
+	guint generation;
+} SvgAreaTileData;
+static void svg_area_tile_data_free(SvgAreaTileData* data) {
+	g_object_unref(data->handle);
+	g_free(data);
+}
+
+static void nk_latex_svg_area_tile_thread(GTask* task, gpointer, SvgAreaTileData* data, GCancellable*) {
+	// scrolled away or zoomed on while queued
+	if (g_task_return_error_if_cancelled(task))
+		return;
+	g_task_return_pointer(task, nk_latex_svg_rasterize_tile(data->handle, &data->geometry, data->width, data->height, data->zoom, data->scale, data->tx, data->ty), g_object_unref);
+}
+
+static void nk_latex_svg_area_tile_cb(GObject* src, GAsyncResult* res, gpointer) {
+	NkLatexSvgArea* self = NK_LATEX_SVG_AREA(src);
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	SvgAreaTileData* data = g_task_get_task_data(G_TASK(res));
+
+	GdkTexture* texture = g_task_propagate_pointer(G_TASK(res), NULL);
+	if (!texture)
+		return;
+	if (data->generation != priv->tiles_generation) {
+		g_object_unref(texture);
+		return;
+	}
+
+	guint64 key = nk_latex_svg_area_tile_key(data->tx, data->ty);
+	g_hash_table_remove(priv->tiles_pending, &key);
+	g_hash_table_insert(priv->tiles, g_memdup2(&key, sizeof(key)), texture);
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+static void nk_latex_svg_area_snapshot_tiles(NkLatexSvgArea* self, GtkSnapshot* snapshot, int width, int height, int scale) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+
+	int level = (int)ceil(log2(priv->zoom) * NK_SVG_ZOOM_STEPS);
+	if (level != priv->tile_level || width != priv->tile_width || height != priv->tile_height || scale != priv->tile_scale) {
+		nk_latex_svg_area_clear_tiles(priv);
+		priv->tile_level = level;
+		priv->tile_width = width;
+		priv->tile_height = height;
+		priv->tile_scale = scale;
+	}
+	double tile_zoom = exp2((double)level / NK_SVG_ZOOM_STEPS);
+	// widget units per tile pixel
+	double f = priv->zoom / (tile_zoom * scale);
+
+	int tx0 = (int)floor(-priv->pan_x / f / NK_SVG_TILE);
+	int ty0 = (int)floor(-priv->pan_y / f / NK_SVG_TILE);
+	int tx1 = (int)floor((width - priv->pan_x) / f / NK_SVG_TILE);
+	int ty1 = (int)floor((height - priv->pan_y) / f / NK_SVG_TILE);
+
+	if (g_hash_table_size(priv->tiles) > NK_SVG_TILE_CACHE) {
+		GHashTableIter iter;
+		guint64* key;
+		g_hash_table_iter_init(&iter, priv->tiles);
+		while (g_hash_table_iter_next(&iter, (gpointer*)&key, NULL)) {
+			int tx = (gint32)(*key >> 32), ty = (gint32)(*key & 0xffffffff);
+			if (tx < tx0 || tx > tx1 || ty < ty0 || ty > ty1)
+				g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	for (int ty = ty0; ty <= ty1; ty++) {
+		for (int tx = tx0; tx <= tx1; tx++) {
+			guint64 key = nk_latex_svg_area_tile_key(tx, ty);
+			GdkTexture* tile = g_hash_table_lookup(priv->tiles, &key);
+			if (tile) {
+				gtk_snapshot_append_texture(snapshot, tile, &GRAPHENE_RECT_INIT(priv->pan_x + tx * NK_SVG_TILE * f, priv->pan_y + ty * NK_SVG_TILE * f, NK_SVG_TILE * f, NK_SVG_TILE * f));
+				continue;
+			}
+			if (g_hash_table_contains(priv->tiles_pending, &key))
+				continue;
+
+			if (!priv->tiles_raster)
+				priv->tiles_raster = g_cancellable_new();
+			SvgAreaTileData* data = g_new(SvgAreaTileData, 1);
+			data->handle = g_object_ref(priv->handle);
+			data->geometry = priv->geometry;
+			data->width = width;
+			data->height = height;
+			data->scale = scale;
+			data->zoom = tile_zoom;
+			data->tx = tx;
+			data->ty = ty;
+			data->generation = priv->tiles_generation;
+			g_hash_table_add(priv->tiles_pending, g_memdup2(&key, sizeof(key)));
+
+			GTask* task = g_task_new(self, priv->tiles_raster, nk_latex_svg_area_tile_cb, NULL);
+			g_task_set_task_data(task, data, (GDestroyNotify)svg_area_tile_data_free);
+			g_task_run_in_thread(task, (GTaskThreadFunc)nk_latex_svg_area_tile_thread);
+			g_object_unref(task);
+		}
+	}
+}
+
 static void nk_latex_svg_area_snapshot(GtkWidget* widget, GtkSnapshot* snapshot) {
 	NkLatexSvgArea* self = NK_LATEX_SVG_AREA(widget);
 	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
 
 	g_return_if_fail(RSVG_HANDLE(*priv->svg));
 	
-	cairo_t* ctx;
-	int width, height;
+	int width, height, scale;
 	
 	width = gtk_widget_get_width(widget);
 	height = gtk_widget_get_height(widget);
-	ctx = gtk_snapshot_append_cairo(snapshot, &GRAPHENE_RECT_INIT (0, 0, width, height));
-	
-	RsvgRectangle rect;
-	rsvg_handle_get_intrinsic_dimensions(*priv->svg, NULL, NULL, NULL, NULL, NULL, &rect);
-	rect.width = width-2*rect.x;
-	rect.height = height-2*rect.y;
-	rsvg_handle_render_document(*priv->svg, ctx, &rect, NULL);
+	scale = gtk_widget_get_scale_factor(widget);
+	if (width <= 0 || height <= 0)
+		return;
 
-	cairo_destroy(ctx);
+	nk_latex_svg_area_sync(self);
+
+	// large TikZ output takes long to rasterize, never do it here. Until the
+	// new texture is ready the stale one is stretched, or nothing drawn if
+	// there is none yet
+	if (!priv->texture || priv->tex_stale || priv->tex_width != width || priv->tex_height != height || priv->tex_scale != scale) {
+		if (!priv->raster || priv->raster_width != width || priv->raster_height != height || priv->raster_scale != scale) {
+			nk_latex_svg_area_cancel_raster(priv);
+			priv->raster = g_cancellable_new();
+			priv->raster_width = width;
+			priv->raster_height = height;
+			priv->raster_scale = scale;
+
+			SvgAreaRasterData* data = g_new(SvgAreaRasterData, 1);
+			data->handle = g_object_ref(priv->handle);
+			data->geometry = priv->geometry;
+			data->width = width;
+			data->height = height;
+			data->scale = scale;
+
+			GTask* task = g_task_new(self, priv->raster, nk_latex_svg_area_raster_cb, NULL);
+			g_task_set_task_data(task, data, (GDestroyNotify)svg_area_raster_data_free);
+			g_task_run_in_thread(task, (GTaskThreadFunc)nk_latex_svg_area_raster_thread);
+			g_object_unref(task);
+		}
+	}
+	if (!priv->texture)
+		return;
+
+	if (priv->zoom <= 1.0) {
+		gtk_snapshot_append_texture(snapshot, priv->texture, &GRAPHENE_RECT_INIT(0, 0, width, height));
+		return;
+	}
+
+	nk_latex_svg_area_clamp(self);
+	gtk_snapshot_push_clip(snapshot, &GRAPHENE_RECT_INIT(0, 0, width, height));
+	gtk_snapshot_append_texture(snapshot, priv->texture, &GRAPHENE_RECT_INIT(priv->pan_x, priv->pan_y, width * priv->zoom, height * priv->zoom));
+	nk_latex_svg_area_snapshot_tiles(self, snapshot, width, height, scale);
+	gtk_snapshot_pop(snapshot);
 }
 
 static void nk_latex_svg_area_measure(GtkWidget* widget, GtkOrientation orientation, int for_size, int* min, int* nat, int*, int*) {
@@ -136,8 +660,8 @@ static void nk_latex_svg_area_measure(GtkWidget* widget, GtkOrientation orientat
 
 	g_return_if_fail(RSVG_HANDLE(*priv->svg));
 	
-	RsvgRectangle rect;
-	rsvg_handle_get_intrinsic_dimensions(RSVG_HANDLE(*priv->svg), NULL, NULL, NULL, NULL, NULL, &rect);
+	nk_latex_svg_area_sync(self);
+	RsvgRectangle rect = priv->geometry;
 
 	if (orientation == GTK_ORIENTATION_HORIZONTAL) {
 		*min = 2*(rect.x + rect.width);
@@ -163,8 +687,112 @@ GtkSizeRequestMode nk_latex_svg_area_get_request_mode(GtkWidget*) {
 	return GTK_SIZE_REQUEST_WIDTH_FOR_HEIGHT;
 }
 
-static void nk_latex_svg_area_init(NkLatexSvgArea*) {}
+static void nk_latex_svg_area_dispose(GObject* object) {
+	NkLatexSvgArea* self = NK_LATEX_SVG_AREA(object);
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+
+	nk_latex_svg_area_cancel_raster(priv);
+	g_clear_object(&priv->texture);
+	g_clear_object(&priv->handle);
+	if (priv->tiles) {
+		nk_latex_svg_area_clear_tiles(priv);
+		g_clear_pointer(&priv->tiles, g_hash_table_unref);
+		g_clear_pointer(&priv->tiles_pending, g_hash_table_unref);
+	}
+
+	G_OBJECT_CLASS(nk_latex_svg_area_parent_class)->dispose(object);
+}
+
+static void svg_area_motion(GtkEventControllerMotion*, double x, double y, NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	priv->pointer_x = x;
+	priv->pointer_y = y;
+}
+
+static gboolean svg_area_scroll(GtkEventControllerScroll* controller, double dx, double dy, NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	GdkModifierType state = gtk_event_controller_get_current_event_state(GTK_EVENT_CONTROLLER(controller));
+
+	if (state & GDK_CONTROL_MASK) {
+		nk_latex_svg_area_zoom_at(self, priv->zoom * pow(1.2, -dy), priv->pointer_x, priv->pointer_y);
+		return TRUE;
+	}
+	// not zoomed in, leave scrolling to the pane
+	if (priv->zoom <= 1.0)
+		return FALSE;
+
+	double step = gtk_event_controller_scroll_get_unit(controller) == GDK_SCROLL_UNIT_WHEEL ? 40.0 : 1.0;
+	nk_latex_svg_area_pan_by(self, -dx * step, -dy * step);
+	return TRUE;
+}
+
+static void svg_area_zoom_begin(GtkGesture*, GdkEventSequence*, NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	priv->zoom_begin = priv->zoom;
+}
+
+static void svg_area_zoom_changed(GtkGestureZoom* gesture, double scale, NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	double x, y;
+	gtk_gesture_get_bounding_box_center(GTK_GESTURE(gesture), &x, &y);
+	nk_latex_svg_area_zoom_at(self, priv->zoom_begin * scale, x, y);
+}
+
+static void svg_area_drag_begin(GtkGestureDrag*, double, double, NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	priv->pan_begin_x = priv->pan_x;
+	priv->pan_begin_y = priv->pan_y;
+}
+
+static void svg_area_drag_update(GtkGestureDrag*, double dx, double dy, NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	if (priv->zoom <= 1.0)
+		return;
+	nk_latex_svg_area_pan_by(self, priv->pan_begin_x + dx - priv->pan_x, priv->pan_begin_y + dy - priv->pan_y);
+}
+
+// double click goes back to fitting the widget
+static void svg_area_pressed(GtkGestureClick*, int n_press, double, double, NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	if (n_press != 2)
+		return;
+	priv->zoom = 1.0;
+	priv->pan_x = priv->pan_y = 0.0;
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+static void nk_latex_svg_area_init(NkLatexSvgArea* self) {
+	NkLatexSvgAreaPrivate* priv = nk_latex_svg_area_get_instance_private(self);
+	priv->zoom = 1.0;
+	priv->tiles = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_object_unref);
+	priv->tiles_pending = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+
+	GtkEventController* motion = gtk_event_controller_motion_new();
+	g_signal_connect(motion, "motion", G_CALLBACK(svg_area_motion), self);
+	gtk_widget_add_controller(GTK_WIDGET(self), motion);
+
+	GtkEventController* scroll = gtk_event_controller_scroll_new(GTK_EVENT_CONTROLLER_SCROLL_BOTH_AXES);
+	g_signal_connect(scroll, "scroll", G_CALLBACK(svg_area_scroll), self);
+	gtk_widget_add_controller(GTK_WIDGET(self), scroll);
+
+	GtkGesture* zoom = gtk_gesture_zoom_new();
+	g_signal_connect(zoom, "begin", G_CALLBACK(svg_area_zoom_begin), self);
+	g_signal_connect(zoom, "scale-changed", G_CALLBACK(svg_area_zoom_changed), self);
+	gtk_widget_add_controller(GTK_WIDGET(self), GTK_EVENT_CONTROLLER(zoom));
+
+	GtkGesture* drag = gtk_gesture_drag_new();
+	g_signal_connect(drag, "drag-begin", G_CALLBACK(svg_area_drag_begin), self);
+	g_signal_connect(drag, "drag-update", G_CALLBACK(svg_area_drag_update), self);
+	gtk_widget_add_controller(GTK_WIDGET(self), GTK_EVENT_CONTROLLER(drag));
+
+	GtkGesture* click = gtk_gesture_click_new();
+	g_signal_connect(click, "pressed", G_CALLBACK(svg_area_pressed), self);
+	gtk_widget_add_controller(GTK_WIDGET(self), GTK_EVENT_CONTROLLER(click));
+}
 static void nk_latex_svg_area_class_init(NkLatexSvgAreaClass* class) {
+	GObjectClass* object_class = G_OBJECT_CLASS(class);
+	object_class->dispose = nk_latex_svg_area_dispose;
+
 	GtkWidgetClass* widget_class = GTK_WIDGET_CLASS(class);
 	widget_class->measure = nk_latex_svg_area_measure;
 	widget_class->get_request_mode = nk_latex_svg_area_get_request_mode;
@@ -183,6 +811,13 @@ void nk_latex_svg_area_set_svg(NkLatexSvgArea* self, RsvgHandle** svg) {
 	priv->svg = svg;
 }
 
+/* To be called after *svg was replaced. */
+void nk_latex_svg_area_update(NkLatexSvgArea* self) {
+	g_return_if_fail(NK_LATEX_IS_SVG_AREA(self));
+
+	gtk_widget_queue_resize(GTK_WIDGET(self));
+}
+
 typedef struct {
 	GtkWidget* parent;
 	GtkWidget* sister;
@@ -240,181 +875,3347 @@ void nk_latex_size_container_set_widgets(NkLatexSizeContainer* self, GtkWidget*
 	priv->sister = sister;
 }
 
-enum {
-	PANE_EDIT,
-	PANE_RENDER
+/* Optional packages. Each one is loaded if the input uses it or its setting
+ * forces it on, so a plain formula doesn't pay for loading TikZ. */
+typedef struct NkPackage {
+	const gchar* name;
+	const gchar* setting;
+	// NULL terminated, matched anywhere in the input
+	const gchar* triggers[4];
+} NkPackage;
+
+static const NkPackage nk_packages[] = {
+	{ "tikz", "pkg-tikz", { "tikzpicture", "\\tikz", NULL } },
+	{ "circuitikz", "pkg-circuitikz", { "circuitikz", "\\ctikz", NULL } },
+	{ "chemfig", "pkg-chemfig", { "\\chemfig", "\\schemestart", "\\definesubmol", NULL } },
+	{ "mhchem", "pkg-mhchem", { "\\ce{", "\\ce ", "\\pu{", NULL } },
 };
 
-typedef struct LatexResultDataCb {
-	int doc_fd;
-	int svg_fd;
-	GtkButton* btn;
-	RsvgHandle** svg;
-	GtkWidget* res_stack;
-	NkLatexSvgArea* render;
-	GtkLabel* error;
-} LatexResultDataCb;
-void latex_result_cb(GObject* src, GAsyncResult* res, LatexResultDataCb* user_data) {
-	gtk_widget_set_sensitive(GTK_WIDGET(user_data->btn), TRUE);
-	gtk_widget_set_visible(GTK_WIDGET(user_data->res_stack), TRUE);
+static gboolean nk_package_used(const NkPackage* package, const gchar* input) {
+	for (const gchar* const* trigger = package->triggers; *trigger; trigger++)
+		if (strstr(input, *trigger))
+			return TRUE;
+	return FALSE;
+}
 
-	GError* err = NULL;
-	if (!g_subprocess_wait_finish(G_SUBPROCESS(src), res, &err)) {
-		g_critical("failed wating for latex: %s\n", err->message);
-		g_error_free(err);
-		return;
+/* Builds the preamble for input, NULL for just the forced packages. */
+gchar* nk_latex_preamble_new(GSettings* settings, const gchar* input) {
+	GString* packages;
+	gchar* custom_preamble;
+	gchar* preamble;
+
+	packages = g_string_new("");
+	for (guint i = 0; i < G_N_ELEMENTS(nk_packages); i++)
+		if (g_settings_get_boolean(settings, nk_packages[i].setting) || (input && nk_package_used(&nk_packages[i], input)))
+			g_string_append_printf(packages, "\\usepackage{%s}\n", nk_packages[i].name);
+
+	custom_preamble = g_settings_get_string(settings, "custom-preamble");
+
+	preamble = g_strdup_printf(	"\\documentclass[10pt,dvisvgm]{article}\n"
+					"\\usepackage{amsmath}\n"
+					"\\usepackage{amssymb}\n"
+					"\\usepackage[usenames]{color}\n"
+					"\\usepackage{iftex}\n"
+					"\n"
+					"%% LaTeX compiler (DVI mode)\n"
+					"\\ifPDFTeX\n"
+					"\n"
+					"    %% Uncomment this line for sans-serif maths font\n"
+					"    %%\\everymath{\\mathsf{\\xdef\\mysf{\\mathgroup\\the\\mathgroup\\relax}}\\mysf}\n"
+					"\n"
+					"%% XeLaTeX, LuaLaTeX and Tectonic\n"
+					"\\else\n"
+					"\n"
+					"    \\usepackage{fontspec}\n"
+					"    \\usepackage{unicode-math}\n"
+					"\n"
+					"    %% Uncomment these lines for alternative fonts\n"
+					"    %%\\setmainfont{FreeSerif}\n"
+					"    %%\\setmathfont{FreeSerif}\n"
+					"\n"
+					"\\fi\n"
+					"\n"
+					"%s"
+					"%s"
+					"\n"
+					"\\pagestyle{empty}\n"
+					"\n", packages->str, custom_preamble);
+
+	g_string_free(packages, TRUE);
+	g_free(custom_preamble);
+	return preamble;
+}
+
+gchar* nk_latex_blocks_join(const gchar* input);
+
+/* Wraps input into a complete document. If input_line is non-NULL it receives
+ * the line of the document the first line of input ends up on. */
+gchar* nk_latex_document_new(const gchar* preamble, const gchar* input, gint* input_line) {
+	if (input_line) {
+		*input_line = 8;
+		for (const gchar* c = preamble; *c; c++)
+			if (*c == '\n')
+				(*input_line)++;
 	}
-	
-	close(user_data->doc_fd);
 
-	gint sign = g_subprocess_get_exit_status(G_SUBPROCESS(src));
-	if (sign) {
-		GInputStream* stderr_stream;
-		GBytes* stderr_content;
-		g_warning("compilation failed: scriped returned POSIX %d\n", sign);
+	gchar* body = nk_latex_blocks_join(input);
+	gchar* doc = g_strdup_printf(	"%s"
+				"\\begin{document}\n"
+				"\\newsavebox{\\eqbox}\n"
+				"\\newlength{\\width}\n"
+				"\\newlength{\\height}\n"
+				"\\newlength{\\depth}\n"
+				"\\begin{lrbox}{\\eqbox}\n"
+				"{$\\displaystyle\n"
+				"	%s\n"
+				"$}\n"
+				"\\end{lrbox}\n"
+				"\\settowidth {\\width}  {\\usebox{\\eqbox}}\n"
+				"\\settoheight{\\height} {\\usebox{\\eqbox}}\n"
+				"\\settodepth {\\depth}  {\\usebox{\\eqbox}}\n"
+				"\\newwrite\\file\n"
+				"\\immediate\\openout\\file=\\jobname.bsl\n"
+				"\\immediate\\write\\file{Depth = \\the\\depth}\n"
+				"\\immediate\\write\\file{Height = \\the\\height}\n"
+				"\\addtolength{\\height} {\\depth}\n"
+				"\\immediate\\write\\file{TotalHeight = \\the\\height}\n"
+				"\\immediate\\write\\file{Width = \\the\\width}\n"
+				"\\closeout\\file\n"
+				"\\usebox{\\eqbox}\n"
+				"\\end{document}\n"
+				"\n", preamble, body);
+	g_free(body);
+	return doc;
+}
+
+/* Incremental compilation.
+ *
+ * With incremental-blocks set, input is compiled as a stack of independent
+ * blocks: every run of lines between top-level blank lines is a document of
+ * its own. The render cache then only misses on the blocks that changed, and
+ * those compile in parallel. Input whose blocks don't stand on their own is
+ * compiled as a whole.
+ */
+
+// blocks can't see each other's definitions, such input compiles as a whole
+static gboolean nk_latex_blocks_independent(const gchar* input) {
+	static const gchar* const definitions[] = { "\\def", "\\gdef", "\\edef", "\\let", "\\newcommand", "\\renewcommand", "\\DeclareMathOperator", "\\newenvironment", "\\setlength", "\\tikzset" };
+	for (guint i = 0; i < G_N_ELEMENTS(definitions); i++)
+		if (strstr(input, definitions[i]))
+			return FALSE;
+	return TRUE;
+}
 
-		stderr_stream = g_subprocess_get_stderr_pipe(G_SUBPROCESS(src));
-		GError* err = NULL;
-		stderr_content = g_input_stream_read_bytes(stderr_stream, 65536, NULL, &err);
-		if (err) {
-			g_critical("failed reading stderr from compilation: %s\n", err->message);
-			g_error_free(err);
-			return;
+// a block starting or ending in an operator continues its neighbour
+static gboolean nk_latex_block_standalone(const gchar* block) {
+	static const gchar dangling[] = "=+-*/<>,&^_";
+	static const gchar* const operators[] = { "\\\\", "\\cdot", "\\times", "\\to", "\\le", "\\ge", "\\leq", "\\geq", "\\neq",
+		"\\pm", "\\mp", "\\approx", "\\equiv", "\\iff", "\\implies", "\\quad", "\\qquad" };
+
+	gchar* text = g_strstrip(g_strdup(block));
+	gsize len = strlen(text);
+	gboolean standalone = !len || (!strchr(dangling, text[0]) && !strchr(dangling, text[len - 1]));
+	for (guint i = 0; i < G_N_ELEMENTS(operators) && standalone; i++) {
+		gsize op_len = strlen(operators[i]);
+		if (g_str_has_suffix(text, operators[i]))
+			standalone = FALSE;
+		// \le but not \left
+		else if (g_str_has_prefix(text, operators[i]) && !g_ascii_isalpha(text[op_len]))
+			standalone = FALSE;
+	}
+	g_free(text);
+	return standalone;
+}
+
+/* Splits input into its top-level blocks. The line of input each block starts
+ * on is appended to lines. Blank lines separate blocks unless they are inside
+ * braces or an environment. */
+GPtrArray* nk_latex_blocks_split(const gchar* input, GArray* lines) {
+	GPtrArray* blocks = g_ptr_array_new_with_free_func(g_free);
+	gchar** input_lines = g_strsplit(input, "\n", -1);
+	GString* block = g_string_new("");
+	gint braces = 0;
+	gint envs = 0;
+
+	for (gint line = 0; input_lines[line]; line++) {
+		const gchar* text = input_lines[line];
+		gboolean top = braces == 0 && envs == 0;
+		const gchar* start = text;
+		while (g_ascii_isspace(*start))
+			start++;
+
+		if (top && !*start && block->len) {
+			// a trailing newline would end up as a blank line in the document
+			g_ptr_array_add(blocks, g_strndup(block->str, block->len - 1));
+			g_string_truncate(block, 0);
+		}
+		if (top && !*start)
+			continue;
+		if (!block->len)
+			g_array_append_val(lines, line);
+		g_string_append_printf(block, "%s\n", text);
+
+		for (const gchar* c = text; *c && *c != '%'; c++) {
+			if (*c == '\\') {
+				if (g_str_has_prefix(c, "\\begin{")) {
+					envs++;
+				} else if (g_str_has_prefix(c, "\\end{")) {
+					envs--;
+				}
+				if (c[1])
+					c++;
+			} else if (*c == '{') {
+				braces++;
+			} else if (*c == '}') {
+				braces--;
+			}
 		}
 
-		gtk_label_set_text(user_data->error, (const char*)g_bytes_get_data(stderr_content, NULL));
-		gtk_widget_set_visible(GTK_WIDGET(user_data->render), FALSE);
-		
-		g_bytes_unref(stderr_content);
-		g_object_unref(stderr_stream);
-		return;
+		// unbalanced input gets compiled and reported as is
+		braces = MAX(braces, 0);
+		envs = MAX(envs, 0);
 	}
-	
-	off_t size = lseek(user_data->svg_fd, 0, SEEK_END);
-	lseek(user_data->svg_fd, 0, SEEK_SET);
-	char* buffer = malloc(size + 1);
-	
-	read(user_data->svg_fd, buffer, size);
-	buffer[size] = 0x0;
-	printf("svg: %s\n", buffer);
-	
-	const gchar* i = g_strdup_printf("/proc/self/fd/%d", user_data->svg_fd);
-	RsvgHandle* handle;
-	GError* perr = NULL;
-	handle = rsvg_handle_new_from_file(i, &err);
-	if (perr) {
-		g_warning("unable to parse svg: %s\n", perr->message);
-		g_error_free(perr);
-	} else {
-		g_object_unref(*user_data->svg);
-		*user_data->svg = handle;
-		//RsvgRectangle rect;
-		//rsvg_handle_get_intrinsic_dimensions(handle, NULL, NULL, NULL, NULL, NULL, &rect);
-		//gtk_drawing_area_set_content_width(user_data->render, 2*(rect.width+rect.x));
-		//gtk_drawing_area_set_content_height(user_data->render, rect.height + rect.y);
-		gtk_widget_set_visible(GTK_WIDGET(user_data->render), TRUE);
-		gtk_widget_queue_draw(GTK_WIDGET(user_data->render));
+	if (block->len)
+		g_ptr_array_add(blocks, g_strndup(block->str, block->len - 1));
+
+	g_string_free(block, TRUE);
+	g_strfreev(input_lines);
+	return blocks;
+}
+
+/* Joins the top-level blocks of input back together for a single document.
+ * Blank lines in between are paragraph breaks, which math mode rejects; they
+ * become empty comments so errors keep their line numbers. */
+gchar* nk_latex_blocks_join(const gchar* input) {
+	GArray* lines = g_array_new(FALSE, FALSE, sizeof(gint));
+	GPtrArray* blocks = nk_latex_blocks_split(input, lines);
+	GString* joined = g_string_new("");
+	gint line = 0;
+
+	for (guint i = 0; i < blocks->len; i++) {
+		const gchar* block = g_ptr_array_index(blocks, i);
+		if (i > 0) {
+			g_string_append_c(joined, '\n');
+			line++;
+		}
+		for (; line < g_array_index(lines, gint, i); line++)
+			g_string_append(joined, "%\n");
+		g_string_append(joined, block);
+		for (const gchar* c = block; *c; c++)
+			if (*c == '\n')
+				line++;
 	}
-	
-	g_free(buffer);
-	g_object_unref(src);
-	g_free(user_data);
+
+	g_ptr_array_unref(blocks);
+	g_array_unref(lines);
+	return g_string_free(joined, FALSE);
 }
 
-static void updated_image_path(GObject* src, GAsyncResult* res, gpointer) {
-	GError* err = NULL;
-	if (!g_dbus_connection_call_finish(G_DBUS_CONNECTION(src), res, &err)) {
-		g_warning("Error %d failed updating edata path of image: %s\n", err->code, err->message);
-		g_error_free(err);
-		return;
+/* TeX engines.
+ *
+ * Every engine has to produce a DVI-like file for dvisvgm. latex runs pdfTeX
+ * in DVI mode and is by far the fastest for plain math, xelatex is needed as
+ * soon as the document wants Unicode input or system fonts. "auto" picks
+ * between those two per document.
+ */
+typedef enum {
+	NK_ENGINE_XELATEX,
+	NK_ENGINE_LATEX,
+	NK_ENGINE_LUALATEX,
+	NK_ENGINE_TECTONIC,
+	NK_N_ENGINES
+} NkEngine;
+
+typedef struct NkEngineInfo {
+	// as in the "engine" setting
+	const gchar* name;
+	const gchar* program;
+	// format the preamble formats are based on, NULL if the engine can't dump them
+	const gchar* format;
+	// what dvisvgm and the .bsl are read from
+	const gchar* jobname;
+	const gchar* output;
+} NkEngineInfo;
+
+static const NkEngineInfo nk_engines[NK_N_ENGINES] = {
+	[NK_ENGINE_XELATEX] = { "xelatex", "xelatex", "xelatex", "nklatex", "nklatex.xdv" },
+	[NK_ENGINE_LATEX] = { "latex", "latex", "latex", "nklatex", "nklatex.dvi" },
+	// LuaTeX can't restore fontspec's Lua state from a dumped format
+	[NK_ENGINE_LUALATEX] = { "lualatex", "dvilualatex", NULL, "nklatex", "nklatex.dvi" },
+	// tectonic keeps its own format cache and always names stdin texput
+	[NK_ENGINE_TECTONIC] = { "tectonic", "tectonic", NULL, "texput", "texput.xdv" },
+};
+
+gboolean nk_engine_available(NkEngine engine) {
+	static gint available[NK_N_ENGINES];
+	if (!available[engine]) {
+		gchar* path = g_find_program_in_path(nk_engines[engine].program);
+		available[engine] = path ? 1 : -1;
+		g_free(path);
 	}
+	return available[engine] > 0;
+}
+
+// what only XeTeX/LuaTeX can handle
+static gboolean nk_engine_needs_unicode(const gchar* text) {
+	for (const gchar* c = text; *c; c++)
+		if ((guchar)*c >= 0x80)
+			return TRUE;
+	return strstr(text, "fontspec") || strstr(text, "unicode-math") || strstr(text, "\\setmainfont") || strstr(text, "\\setmathfont");
+}
+
+/* Picks the engine for compiling input with the current settings. An engine
+ * that isn't installed falls back to xelatex. */
+NkEngine nk_engine_choose(GSettings* settings, const gchar* input) {
+	gchar* name = g_settings_get_string(settings, "engine");
+	NkEngine engine = NK_ENGINE_XELATEX;
+
+	if (g_str_equal(name, "auto")) {
+		gchar* custom_preamble = g_settings_get_string(settings, "custom-preamble");
+		if (!nk_engine_needs_unicode(input) && !nk_engine_needs_unicode(custom_preamble))
+			engine = NK_ENGINE_LATEX;
+		g_free(custom_preamble);
+	} else {
+		for (guint i = 0; i < NK_N_ENGINES; i++)
+			if (g_str_equal(name, nk_engines[i].name))
+				engine = i;
+	}
+	g_free(name);
+
+	if (!nk_engine_available(engine))
+		engine = NK_ENGINE_XELATEX;
+	return engine;
+}
+
+typedef gboolean (*NkWaitFunc)(gpointer data);
+
+static gboolean nk_wait_expired(gboolean* expired) {
+	*expired = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+/* Iterates the default main context until done(data) holds, for at most
+ * seconds. Returns FALSE if it gave up. Only for the headless modes, which
+ * have no main loop of their own to wait in. */
+gboolean nk_wait(NkWaitFunc done, gpointer data, guint seconds) {
+	gboolean expired = FALSE;
+	guint source = g_timeout_add_seconds(seconds, (GSourceFunc)nk_wait_expired, &expired);
+	while (!done(data) && !expired)
+		g_main_context_iteration(NULL, TRUE);
+	if (!expired)
+		g_source_remove(source);
+	return !expired;
+}
+
+typedef struct CacheFile {
+	gchar* path;
+	goffset size;
+	gint64 mtime;
+} CacheFile;
+static gint cache_file_cmp(const CacheFile* a, const CacheFile* b) {
+	return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+/* Deletes the least recently modified files ending in suffix in dir, along
+ * with their companion (same name, that suffix) if non-NULL, until they take
+ * up at most max bytes. "<name>-part<suffix>" files are still being written
+ * and left alone. */
+static void nk_cache_dir_trim(const gchar* dir, const gchar* suffix, const gchar* companion, goffset max) {
+	GDir* d = g_dir_open(dir, 0, NULL);
+	if (!d)
+		return;
+
+	gchar* part = g_strconcat("-part", suffix, NULL);
+	GArray* files = g_array_new(FALSE, FALSE, sizeof(CacheFile));
+	goffset total = 0;
+	const gchar* name;
+	while ((name = g_dir_read_name(d))) {
+		if (!g_str_has_suffix(name, suffix) || g_str_has_suffix(name, part))
+			continue;
+
+		CacheFile f;
+		GStatBuf st;
+		f.path = g_build_filename(dir, name, NULL);
+		if (g_stat(f.path, &st) != 0) {
+			g_free(f.path);
+			continue;
+		}
+		f.size = st.st_size;
+		f.mtime = st.st_mtime;
+		total += f.size;
+		g_array_append_val(files, f);
+	}
+	g_dir_close(d);
+	g_free(part);
+
+	g_array_sort(files, (GCompareFunc)cache_file_cmp);
+	for (guint i = 0; i < files->len; i++) {
+		CacheFile* f = &g_array_index(files, CacheFile, i);
+		if (total > max) {
+			g_unlink(f->path);
+			if (companion) {
+				gchar* base = g_strndup(f->path, strlen(f->path) - strlen(suffix));
+				gchar* companion_path = g_strconcat(base, companion, NULL);
+				g_unlink(companion_path);
+				g_free(companion_path);
+				g_free(base);
+			}
+			total -= f->size;
+		}
+		g_free(f->path);
+	}
+	g_array_free(files, TRUE);
+}
+
+/* Limits for every TeX process, render jobs and format builds alike, so one
+ * runaway \foreach can't keep a core busy or eat all memory. timeout is wall-clock seconds for the whole
+ * job, cpu and memory (MiB, address space) are rlimits of each process.
+ * 0 disables a limit. renders is how many jobs may run at once (0 means
+ * one per core), their dvisvgm page runs split the cores between them. */
+typedef struct NkTexLimits {
+	guint timeout;
+	guint cpu;
+	guint memory;
+	guint renders;
+} NkTexLimits;
+
+static NkTexLimits nk_tex_limits;
+
+void nk_tex_limits_load(GSettings* settings) {
+	nk_tex_limits.timeout = g_settings_get_int(settings, "render-timeout");
+	nk_tex_limits.cpu = g_settings_get_int(settings, "render-cpu");
+	nk_tex_limits.memory = g_settings_get_int(settings, "render-memory");
+}
+
+// runs in the forked child, only async-signal-safe calls
+static void nk_tex_child_setup(gpointer data) {
+	const NkTexLimits* limits = data;
+	struct rlimit rl;
+	if (limits->cpu) {
+		// SIGXCPU first, SIGKILL if that gets ignored
+		rl.rlim_cur = limits->cpu;
+		rl.rlim_max = limits->cpu + 1;
+		setrlimit(RLIMIT_CPU, &rl);
+	}
+	if (limits->memory) {
+		rl.rlim_cur = rl.rlim_max = (rlim_t)limits->memory << 20;
+		setrlimit(RLIMIT_AS, &rl);
+	}
+}
+
+static void nk_tex_launcher_set_limits(GSubprocessLauncher* launcher) {
+	g_subprocess_launcher_set_child_setup(launcher, nk_tex_child_setup, g_memdup2(&nk_tex_limits, sizeof(nk_tex_limits)), g_free);
+}
+
+typedef struct NkTexWorkerPool NkTexWorkerPool;
+NkTexWorkerPool* nk_tex_worker_pool_get_default(void);
+void nk_tex_worker_pool_prepare(NkTexWorkerPool* self, NkEngine engine, const gchar* fmt, guint size);
+
+/* Precompiled preamble formats.
+ *
+ * Loading the preamble (fontspec, unicode-math and especially TikZ) is most of
+ * the work xelatex does for a typical widget. For every distinct preamble a
+ * format is dumped using mylatexformat into $XDG_CACHE_HOME/<appid>/fmt/<hash>.fmt,
+ * so that later renders only have to typeset the body. The format skips the
+ * preamble of the document it is used with, so the document itself stays
+ * unchanged and still compiles cold while no format is available.
+ *
+ * Formats are several MB each, the least recently used are dropped beyond
+ * NK_FMT_CACHE_DISK_SIZE. Preambles that failed to dump are retried after
+ * NK_FMT_CACHE_RETRY, the failure may have been a package installed since.
+ */
+#define NK_FMT_CACHE_DISK_SIZE (256 * 1024 * 1024)
+#define NK_FMT_CACHE_RETRY (60 * 60)
+// how long the batch waits for builds render-timeout doesn't bound
+#define NK_FMT_CACHE_WAIT (5 * 60)
+
+typedef struct NkFmtCache {
+	gchar* dir;
+	gchar* engine_stamps[NK_N_ENGINES];
+	// hash -> FmtBuildData
+	GHashTable* building;
+	guint rebuild_source;
+} NkFmtCache;
+
+NkFmtCache* nk_fmt_cache_get_default(void) {
+	static NkFmtCache* cache = NULL;
+	if (cache)
+		return cache;
+
+	cache = g_new0(NkFmtCache, 1);
+	cache->dir = g_build_filename(g_get_user_cache_dir(), APPL_ID, "fmt", NULL);
+	if (g_mkdir_with_parents(cache->dir, 0700) == -1)
+		g_warning("failed creating format cache %s: %s\n", cache->dir, g_strerror(errno));
+	cache->building = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	// formats are only valid for the TeX installation they were dumped with,
+	// so an engine upgrade has to invalidate all of them.
+	for (guint i = 0; i < NK_N_ENGINES; i++) {
+		gchar* engine = g_find_program_in_path(nk_engines[i].program);
+		GStatBuf st;
+		if (engine && g_stat(engine, &st) == 0)
+			cache->engine_stamps[i] = g_strdup_printf("%s:%" G_GINT64_FORMAT, engine, (gint64)st.st_mtime);
+		else
+			cache->engine_stamps[i] = g_strdup(nk_engines[i].name);
+		g_free(engine);
+	}
+
+	return cache;
+}
+
+typedef struct FmtBuildData {
+	NkFmtCache* cache;
+	gchar* hash;
+	GSubprocess* proc;
+	guint deadline_source;
+	gboolean timed_out;
+	gboolean aborted;
+} FmtBuildData;
+
+/* Drops the least recently used formats beyond NK_FMT_CACHE_DISK_SIZE,
+ * failure markers that may be retried anyway and logs of builds that are
+ * gone. */
+static void nk_fmt_cache_trim(NkFmtCache* self) {
+	nk_cache_dir_trim(self->dir, ".fmt", NULL, NK_FMT_CACHE_DISK_SIZE);
+
+	GDir* d = g_dir_open(self->dir, 0, NULL);
+	if (!d)
+		return;
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	const gchar* name;
+	while ((name = g_dir_read_name(d))) {
+		gchar* path = g_build_filename(self->dir, name, NULL);
+		GStatBuf st;
+		if (g_str_has_suffix(name, ".failed")) {
+			if (g_stat(path, &st) == 0 && st.st_mtime + NK_FMT_CACHE_RETRY <= now)
+				g_unlink(path);
+		} else if (g_str_has_suffix(name, "-part.log")) {
+			gchar* hash = g_strndup(name, strlen(name) - strlen("-part.log"));
+			if (!g_hash_table_contains(self->building, hash))
+				g_unlink(path);
+			g_free(hash);
+		}
+		g_free(path);
+	}
+	g_dir_close(d);
+}
+
+// a preamble looping forever fails like any other, through the wait callback
+static gboolean nk_fmt_cache_build_deadline(FmtBuildData* data) {
+	data->deadline_source = 0;
+	data->timed_out = TRUE;
+	g_subprocess_force_exit(data->proc);
+	return G_SOURCE_REMOVE;
+}
+
+static void nk_fmt_cache_build_cb(GObject* src, GAsyncResult* res, FmtBuildData* user_data) {
+	gchar* base = g_build_filename(user_data->cache->dir, user_data->hash, NULL);
+	gchar* tex = g_strconcat(base, ".tex", NULL);
+	if (user_data->deadline_source)
+		g_source_remove(user_data->deadline_source);
+
+	GError* err = NULL;
+	gboolean ok = g_subprocess_wait_check_finish(G_SUBPROCESS(src), res, &err);
+	if (user_data->aborted) {
+		g_clear_error(&err);
+		gchar* part = g_strconcat(base, "-part.fmt", NULL);
+		g_unlink(part);
+		g_free(part);
+	} else if (!ok) {
+		// some preambles can't be dumped (e.g. XeTeX refuses to dump native
+		// fonts), remember that so they simply keep compiling cold.
+		if (user_data->timed_out)
+			g_warning("building format for preamble %s took longer than %us\n", user_data->hash, nk_tex_limits.timeout);
+		else
+			g_warning("failed building format for preamble %s: %s\n", user_data->hash, err->message);
+		g_error_free(err);
+
+		gchar* failed = g_strconcat(base, ".failed", NULL);
+		g_file_set_contents(failed, "", 0, NULL);
+		g_free(failed);
+	} else {
+		gchar* part = g_strconcat(base, "-part.fmt", NULL);
+		gchar* fmt = g_strconcat(base, ".fmt", NULL);
+		if (g_rename(part, fmt) == -1)
+			g_warning("failed moving format %s into place: %s\n", part, g_strerror(errno));
+		else
+			g_debug("built format for preamble %s\n", user_data->hash);
+		g_free(part);
+		g_free(fmt);
+	}
+	// the log is written whatever the outcome, nobody reads it
+	gchar* log = g_strconcat(base, "-part.log", NULL);
+	g_unlink(log);
+	g_free(log);
+	g_unlink(tex);
+
+	g_hash_table_remove(user_data->cache->building, user_data->hash);
+	nk_fmt_cache_trim(user_data->cache);
+	g_free(tex);
+	g_free(base);
+	g_object_unref(src);
+	g_free(user_data->hash);
+	g_free(user_data);
+}
+
+static void nk_fmt_cache_build(NkFmtCache* self, NkEngine engine, const gchar* hash, const gchar* preamble) {
+	gchar* tex_name = g_strconcat(hash, ".tex", NULL);
+	gchar* tex_path = g_build_filename(self->dir, tex_name, NULL);
+	gchar* tex = g_strconcat(preamble, "\\begin{document}\n\\end{document}\n", NULL);
+
+	GError* err = NULL;
+	if (!g_file_set_contents(tex_path, tex, -1, &err)) {
+		g_warning("failed writing preamble %s: %s\n", tex_path, err->message);
+		g_error_free(err);
+		goto out;
+	}
+
+	GSubprocessLauncher* launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDOUT_SILENCE | G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+	g_subprocess_launcher_set_cwd(launcher, self->dir);
+	// the preamble is user input just like a document
+	nk_tex_launcher_set_limits(launcher);
+	gchar* jobname = g_strdup_printf("-jobname=%s-part", hash);
+	gchar* format = g_strconcat("&", nk_engines[engine].format, NULL);
+	GSubprocess* proc = g_subprocess_launcher_spawn(launcher, &err, nk_engines[engine].program, "-ini", "-interaction=nonstopmode", jobname, format, "mylatexformat.ltx", tex_name, NULL);
+	g_free(format);
+	g_free(jobname);
+	g_object_unref(launcher);
+	if (!proc) {
+		g_warning("failed launching format build: %s\n", err->message);
+		g_error_free(err);
+		g_unlink(tex_path);
+		goto out;
+	}
+
+	FmtBuildData* build_d = g_new0(FmtBuildData, 1);
+	build_d->cache = self;
+	build_d->hash = g_strdup(hash);
+	build_d->proc = proc;
+	if (nk_tex_limits.timeout)
+		build_d->deadline_source = g_timeout_add_seconds(nk_tex_limits.timeout, (GSourceFunc)nk_fmt_cache_build_deadline, build_d);
+	g_hash_table_insert(self->building, g_strdup(hash), build_d);
+	g_subprocess_wait_async(proc, NULL, (GAsyncReadyCallback)nk_fmt_cache_build_cb, build_d);
+
+out:
+	g_free(tex);
+	g_free(tex_path);
+	g_free(tex_name);
+}
+
+/* Returns the path to pass to -fmt= (without the .fmt suffix) if a format for
+ * this preamble is ready, otherwise starts building one in the background and
+ * returns NULL. Always NULL for engines that can't dump formats. */
+gchar* nk_fmt_cache_lookup(NkFmtCache* self, NkEngine engine, const gchar* preamble) {
+	if (!nk_engines[engine].format)
+		return NULL;
+
+	gchar* key = g_strconcat(self->engine_stamps[engine], "\n", preamble, NULL);
+	gchar* hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+	gchar* base = g_build_filename(self->dir, hash, NULL);
+	gchar* fmt = g_strconcat(base, ".fmt", NULL);
+	gchar* failed = g_strconcat(base, ".failed", NULL);
+	g_free(key);
+
+	gchar* ret = NULL;
+	GStatBuf st;
+	// such preambles keep compiling cold until they may be retried
+	gboolean failed_recently = g_stat(failed, &st) == 0 && st.st_mtime + NK_FMT_CACHE_RETRY > g_get_real_time() / G_USEC_PER_SEC;
+	if (g_file_test(fmt, G_FILE_TEST_IS_REGULAR)) {
+		// keeps it from being trimmed
+		g_utime(fmt, NULL);
+		ret = g_steal_pointer(&base);
+	} else if (!failed_recently && !g_hash_table_contains(self->building, hash)) {
+		g_unlink(failed);
+		nk_fmt_cache_build(self, engine, hash, preamble);
+	}
+
+	g_free(failed);
+	g_free(fmt);
+	g_free(base);
+	g_free(hash);
+	return ret;
+}
+
+static gboolean nk_fmt_cache_idle(NkFmtCache* self) {
+	return g_hash_table_size(self->building) == 0;
+}
+
+/* Iterates the default main context until no format is building any more,
+ * for at most seconds. Returns FALSE if some still are. */
+gboolean nk_fmt_cache_wait(NkFmtCache* self, guint seconds) {
+	return nk_wait((NkWaitFunc)nk_fmt_cache_idle, self, seconds);
+}
+
+/* Kills all format builds, they leave nothing behind and aren't marked as
+ * failed. */
+void nk_fmt_cache_abort(NkFmtCache* self) {
+	GHashTableIter iter;
+	FmtBuildData* build_d;
+	g_hash_table_iter_init(&iter, self->building);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&build_d)) {
+		build_d->aborted = TRUE;
+		g_subprocess_force_exit(build_d->proc);
+	}
+	nk_fmt_cache_wait(self, 5);
+}
+
+static gboolean nk_fmt_cache_rebuild(GSettings* settings) {
+	NkFmtCache* cache = nk_fmt_cache_get_default();
+	cache->rebuild_source = 0;
+
+	// warm both engines auto may pick
+	gchar* preamble = nk_latex_preamble_new(settings, NULL);
+	NkEngine engine = nk_engine_choose(settings, "");
+	gchar* fmt = nk_fmt_cache_lookup(cache, engine, preamble);
+	// have workers waiting before the first render asks for one
+	if (fmt)
+		nk_tex_worker_pool_prepare(nk_tex_worker_pool_get_default(), engine, fmt, g_settings_get_int(settings, "tex-workers"));
+	g_free(fmt);
+	if (engine == NK_ENGINE_LATEX)
+		g_free(nk_fmt_cache_lookup(cache, NK_ENGINE_XELATEX, preamble));
+	g_free(preamble);
+	return G_SOURCE_REMOVE;
+}
+
+static void nk_fmt_cache_settings_changed(GSettings* settings, const gchar* key, gpointer) {
+	NkFmtCache* cache = nk_fmt_cache_get_default();
+	if (cache->rebuild_source)
+		g_source_remove(cache->rebuild_source);
+	// the custom preamble is saved on every keystroke, so wait for it to
+	// settle. Without a key this is startup, which should warm up right away.
+	if (key)
+		cache->rebuild_source = g_timeout_add_seconds(2, (GSourceFunc)nk_fmt_cache_rebuild, settings);
+	else
+		cache->rebuild_source = g_idle_add((GSourceFunc)nk_fmt_cache_rebuild, settings);
+}
+
+/* Parses svg without copying it. */
+RsvgHandle* nk_svg_handle_new(GBytes* svg, GError** err) {
+	GInputStream* stream = g_memory_input_stream_new_from_bytes(svg);
+	RsvgHandle* handle = rsvg_handle_new_from_stream_sync(stream, NULL, RSVG_HANDLE_FLAGS_NONE, NULL, err);
+	g_object_unref(stream);
+	return handle;
+}
+
+typedef enum {
+	NK_TEX_JOB_NONE = 0,
+	// smaller svgs: glyphs shared through <use>, dvisvgm's optimizer, less precision
+	NK_TEX_JOB_OPTIMIZE = 1 << 0,
+	// stacked from separately compiled blocks, only part of render cache keys
+	NK_TEX_JOB_BLOCKS = 1 << 1
+} NkTexJobFlags;
+
+/* Content addressed render cache.
+ *
+ * Renders are keyed on the hash of the complete document handed to the
+ * engine. Recently used results are kept parsed in memory, all results are
+ * stored as <hash>.svg/<hash>.bsl in $XDG_CACHE_HOME/<appid>/render, which is
+ * trimmed back to NK_RENDER_CACHE_DISK_SIZE by dropping the least recently
+ * used entries.
+ */
+#define NK_RENDER_CACHE_MEM_ENTRIES 32
+#define NK_RENDER_CACHE_DISK_SIZE (64 * 1024 * 1024)
+
+typedef struct NkRenderCacheEntry {
+	gchar* key;
+	RsvgHandle* handle;
+	GBytes* svg;
+	GBytes* bsl;
+} NkRenderCacheEntry;
+
+typedef struct NkRenderCache {
+	gchar* dir;
+	GHashTable* entries;
+	GQueue lru;
+
+	guint mem_hits;
+	guint disk_hits;
+	guint misses;
+} NkRenderCache;
+
+static void nk_render_cache_entry_free(NkRenderCacheEntry* entry) {
+	g_free(entry->key);
+	g_object_unref(entry->handle);
+	g_bytes_unref(entry->svg);
+	if (entry->bsl)
+		g_bytes_unref(entry->bsl);
+	g_free(entry);
+}
+
+NkRenderCache* nk_render_cache_get_default(void) {
+	static NkRenderCache* cache = NULL;
+	if (cache)
+		return cache;
+
+	cache = g_new0(NkRenderCache, 1);
+	cache->dir = g_build_filename(g_get_user_cache_dir(), APPL_ID, "render", NULL);
+	if (g_mkdir_with_parents(cache->dir, 0700) == -1)
+		g_warning("failed creating render cache %s: %s\n", cache->dir, g_strerror(errno));
+	// the hash table owns the entries, the lru queue only references their links
+	cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+	g_queue_init(&cache->lru);
+	return cache;
+}
+
+gchar* nk_render_cache_key(const gchar* doc, NkEngine engine, NkTexJobFlags flags) {
+	GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	g_checksum_update(checksum, (const guchar*)doc, -1);
+	// the same document renders differently with another engine or flags
+	guint8 config[2] = { engine, flags };
+	g_checksum_update(checksum, config, sizeof(config));
+	gchar* key = g_strdup(g_checksum_get_string(checksum));
+	g_checksum_free(checksum);
+	return key;
+}
+
+static void nk_render_cache_remember(NkRenderCache* self, NkRenderCacheEntry* entry) {
+	g_queue_push_head(&self->lru, entry);
+	g_hash_table_insert(self->entries, entry->key, self->lru.head);
+
+	while (self->lru.length > NK_RENDER_CACHE_MEM_ENTRIES) {
+		NkRenderCacheEntry* old = g_queue_pop_tail(&self->lru);
+		g_hash_table_remove(self->entries, old->key);
+		nk_render_cache_entry_free(old);
+	}
+}
+
+/* Drops every entry kept in memory, the disk cache stays. */
+void nk_render_cache_clear(NkRenderCache* self) {
+	NkRenderCacheEntry* entry;
+	while ((entry = g_queue_pop_tail(&self->lru))) {
+		g_hash_table_remove(self->entries, entry->key);
+		nk_render_cache_entry_free(entry);
+	}
+}
+
+static void nk_render_cache_print_stats(NkRenderCache* self) {
+	g_debug("render cache: %u memory hits, %u disk hits, %u misses\n", self->mem_hits, self->disk_hits, self->misses);
+}
+
+/* Returns a new reference to the cached entry's handle, or NULL on a miss.
+ * svg and bsl (if non-NULL) receive new references to the raw data. */
+RsvgHandle* nk_render_cache_lookup(NkRenderCache* self, const gchar* key, GBytes** svg, GBytes** bsl) {
+	NkRenderCacheEntry* entry = NULL;
+
+	GList* link = g_hash_table_lookup(self->entries, key);
+	if (link) {
+		entry = link->data;
+		g_queue_unlink(&self->lru, link);
+		g_queue_push_head_link(&self->lru, link);
+		self->mem_hits++;
+	} else {
+		gchar* base = g_build_filename(self->dir, key, NULL);
+		gchar* svg_path = g_strconcat(base, ".svg", NULL);
+		gchar* bsl_path = g_strconcat(base, ".bsl", NULL);
+		GMappedFile* svg_file = g_mapped_file_new(svg_path, FALSE, NULL);
+
+		if (svg_file) {
+			GError* err = NULL;
+			GBytes* svg_data = g_mapped_file_get_bytes(svg_file);
+			RsvgHandle* handle = nk_svg_handle_new(svg_data, &err);
+			g_mapped_file_unref(svg_file);
+			if (!handle) {
+				g_warning("dropping unparsable cache entry %s: %s\n", key, err->message);
+				g_error_free(err);
+				g_bytes_unref(svg_data);
+				g_unlink(svg_path);
+				g_unlink(bsl_path);
+			} else {
+				gchar* bsl_data;
+				gsize bsl_len;
+
+				entry = g_new0(NkRenderCacheEntry, 1);
+				entry->key = g_strdup(key);
+				entry->handle = handle;
+				entry->svg = svg_data;
+				if (g_file_get_contents(bsl_path, &bsl_data, &bsl_len, NULL))
+					entry->bsl = g_bytes_new_take(bsl_data, bsl_len);
+				nk_render_cache_remember(self, entry);
+
+				// mtime doubles as the access time for trimming
+				g_utime(svg_path, NULL);
+				self->disk_hits++;
+			}
+		}
+
+		g_free(bsl_path);
+		g_free(svg_path);
+		g_free(base);
+	}
+
+	if (!entry) {
+		self->misses++;
+		nk_render_cache_print_stats(self);
+		return NULL;
+	}
+	nk_render_cache_print_stats(self);
+
+	if (svg)
+		*svg = g_bytes_ref(entry->svg);
+	if (bsl)
+		*bsl = entry->bsl ? g_bytes_ref(entry->bsl) : NULL;
+	return g_object_ref(entry->handle);
+}
+
+typedef struct RenderCacheStoreData {
+	gchar* dir;
+	gchar* key;
+	GBytes* svg;
+	GBytes* bsl;
+} RenderCacheStoreData;
+static void render_cache_store_data_free(RenderCacheStoreData* data) {
+	g_free(data->dir);
+	g_free(data->key);
+	g_bytes_unref(data->svg);
+	if (data->bsl)
+		g_bytes_unref(data->bsl);
+	g_free(data);
+}
+
+static void nk_render_cache_trim(const gchar* dir) {
+	nk_cache_dir_trim(dir, ".svg", ".bsl", NK_RENDER_CACHE_DISK_SIZE);
+}
+
+static void nk_render_cache_store_thread(GTask* task, gpointer, RenderCacheStoreData* data, GCancellable*) {
+	gchar* base = g_build_filename(data->dir, data->key, NULL);
+	gchar* svg_path = g_strconcat(base, ".svg", NULL);
+	gchar* bsl_path = g_strconcat(base, ".bsl", NULL);
+	gsize len;
+	const gchar* buf;
+
+	GError* err = NULL;
+	// write the bsl first, an svg without its metrics would be picked up as a hit
+	if (data->bsl) {
+		buf = g_bytes_get_data(data->bsl, &len);
+		g_file_set_contents(bsl_path, buf, len, NULL);
+	}
+	buf = g_bytes_get_data(data->svg, &len);
+	if (!g_file_set_contents(svg_path, buf, len, &err)) {
+		g_warning("failed storing render %s: %s\n", data->key, err->message);
+		g_error_free(err);
+	}
+
+	nk_render_cache_trim(data->dir);
+
+	g_free(bsl_path);
+	g_free(svg_path);
+	g_free(base);
+	g_task_return_boolean(task, TRUE);
+}
+
+void nk_render_cache_insert(NkRenderCache* self, const gchar* key, RsvgHandle* handle, GBytes* svg, GBytes* bsl) {
+	if (g_hash_table_contains(self->entries, key))
+		return;
+
+	NkRenderCacheEntry* entry = g_new0(NkRenderCacheEntry, 1);
+	entry->key = g_strdup(key);
+	entry->handle = g_object_ref(handle);
+	entry->svg = g_bytes_ref(svg);
+	entry->bsl = bsl ? g_bytes_ref(bsl) : NULL;
+	nk_render_cache_remember(self, entry);
+
+	RenderCacheStoreData* data = g_new(RenderCacheStoreData, 1);
+	data->dir = g_strdup(self->dir);
+	data->key = g_strdup(key);
+	data->svg = g_bytes_ref(svg);
+	data->bsl = bsl ? g_bytes_ref(bsl) : NULL;
+
+	GTask* task = g_task_new(NULL, NULL, NULL, NULL);
+	g_task_set_task_data(task, data, (GDestroyNotify)render_cache_store_data_free);
+	g_task_run_in_thread(task, (GTaskThreadFunc)nk_render_cache_store_thread);
+	g_object_unref(task);
+}
+
+/* Compiler output.
+ *
+ * Output is drained while the tools run. The raw text is kept in a ring
+ * buffer holding the last NK_TEX_LOG_SIZE bytes, while TeX error records
+ * ("! <message>" followed by "l.<n> <context>") are picked out incrementally
+ * as lines arrive, so they survive even if the ring has wrapped since.
+ */
+#define NK_TEX_LOG_SIZE (64 * 1024)
+#define NK_TEX_LOG_MAX_LINE 1024
+#define NK_TEX_LOG_MAX_ERRORS 64
+
+typedef struct NkTexError {
+	gchar* message;
+	gchar* context;
+	// line in the compiled document, -1 if TeX didn't report one
+	gint line;
+} NkTexError;
+
+typedef struct NkTexLog {
+	gchar ring[NK_TEX_LOG_SIZE];
+	gsize head;
+	gsize len;
+
+	GString* line;
+	GPtrArray* errors;
+	NkTexError* pending;
+} NkTexLog;
+
+static void nk_tex_error_free(NkTexError* error) {
+	g_free(error->message);
+	g_free(error->context);
+	g_free(error);
+}
+
+NkTexLog* nk_tex_log_new(void) {
+	NkTexLog* log = g_new0(NkTexLog, 1);
+	log->line = g_string_new(NULL);
+	log->errors = g_ptr_array_new_with_free_func((GDestroyNotify)nk_tex_error_free);
+	return log;
+}
+
+void nk_tex_log_free(NkTexLog* log) {
+	g_string_free(log->line, TRUE);
+	g_ptr_array_unref(log->errors);
+	g_free(log);
+}
+
+static void nk_tex_log_parse_line(NkTexLog* log, const gchar* line) {
+	if (line[0] == '!' && line[1] == ' ') {
+		if (log->errors->len >= NK_TEX_LOG_MAX_ERRORS)
+			return;
+		NkTexError* error = g_new0(NkTexError, 1);
+		error->message = g_strstrip(g_strdup(line + 2));
+		error->line = -1;
+		g_ptr_array_add(log->errors, error);
+		log->pending = error;
+	} else if (log->pending && line[0] == 'l' && line[1] == '.' && g_ascii_isdigit(line[2])) {
+		gchar* end;
+		log->pending->line = g_ascii_strtoll(line + 2, &end, 10);
+		log->pending->context = g_strstrip(g_strdup(end));
+		log->pending = NULL;
+	}
+}
+
+void nk_tex_log_feed(NkTexLog* log, const gchar* data, gsize len) {
+	for (gsize i = 0; i < len; i++) {
+		if (data[i] == '\n') {
+			nk_tex_log_parse_line(log, log->line->str);
+			g_string_truncate(log->line, 0);
+		} else if (log->line->len < NK_TEX_LOG_MAX_LINE) {
+			g_string_append_c(log->line, data[i]);
+		}
+	}
+
+	if (len > NK_TEX_LOG_SIZE) {
+		data += len - NK_TEX_LOG_SIZE;
+		len = NK_TEX_LOG_SIZE;
+	}
+	while (len) {
+		gsize n = MIN(len, NK_TEX_LOG_SIZE - log->head);
+		memcpy(log->ring + log->head, data, n);
+		log->head = (log->head + n) % NK_TEX_LOG_SIZE;
+		log->len = MIN(log->len + n, NK_TEX_LOG_SIZE);
+		data += n;
+		len -= n;
+	}
+}
+
+void nk_tex_log_feed_bytes(NkTexLog* log, GBytes* bytes) {
+	gsize len;
+	const gchar* data = g_bytes_get_data(bytes, &len);
+	nk_tex_log_feed(log, data, len);
+}
+
+/* Returns the retained (most recent) part of the raw output. */
+GBytes* nk_tex_log_get_text(NkTexLog* log) {
+	gchar* text = g_malloc(log->len);
+	gsize start = (log->head + NK_TEX_LOG_SIZE - log->len) % NK_TEX_LOG_SIZE;
+	gsize first = MIN(log->len, NK_TEX_LOG_SIZE - start);
+	memcpy(text, log->ring + start, first);
+	memcpy(text + first, log->ring, log->len - first);
+	return g_bytes_new_take(text, log->len);
+}
+
+// which limit stopped a job
+typedef enum {
+	NK_TEX_LIMIT_NONE,
+	NK_TEX_LIMIT_TIME,
+	NK_TEX_LIMIT_MEMORY
+} NkTexLimit;
+
+typedef struct NkTexJobResult {
+	gboolean success;
+	NkTexLimit limit;
+	GBytes* svg;
+	GBytes* bsl;
+	GBytes* log;
+	GPtrArray* errors;
+	// microseconds spent in the engine and dvisvgm
+	gint64 engine_time;
+	gint64 dvisvgm_time;
+} NkTexJobResult;
+
+void nk_tex_job_result_free(NkTexJobResult* result) {
+	if (result->svg)
+		g_bytes_unref(result->svg);
+	if (result->bsl)
+		g_bytes_unref(result->bsl);
+	if (result->log)
+		g_bytes_unref(result->log);
+	if (result->errors)
+		g_ptr_array_unref(result->errors);
+	g_free(result);
+}
+
+static void nk_rm_dir(const gchar* path) {
+	GDir* dir = g_dir_open(path, 0, NULL);
+	if (dir) {
+		const gchar* name;
+		while ((name = g_dir_read_name(dir))) {
+			gchar* file = g_build_filename(path, name, NULL);
+			if (g_file_test(file, G_FILE_TEST_IS_DIR) && !g_file_test(file, G_FILE_TEST_IS_SYMLINK))
+				nk_rm_dir(file);
+			else
+				g_unlink(file);
+			g_free(file);
+		}
+		g_dir_close(dir);
+	}
+	g_rmdir(path);
+}
+
+/* TeX jobs.
+ *
+ * A worker is a TeX engine process in a scratch workspace of its own (below
+ * $XDG_RUNTIME_DIR, which usually is a tmpfs) reading its document from
+ * stdin. Cold jobs get the document memfd as stdin directly. Warm workers are
+ * started ahead of time with the format of the current preamble and block on
+ * a stdin pipe until a document arrives, so handing them a job only costs
+ * typesetting the body; the binary startup, the format load and the file
+ * lookup have already happened. dvisvgm then writes the svg straight into the
+ * result memfd; documents shipping out several pages get one dvisvgm per page
+ * running in parallel, and the pages stacked into one svg. Each worker
+ * compiles exactly one document, the pool is refilled from the main loop.
+ */
+typedef struct NkTexWorker {
+	NkEngine engine;
+	GSubprocess* proc;
+	gchar* dir;
+	gint64 spawned;
+} NkTexWorker;
+
+// formats the pool keeps workers waiting for, the least recently used goes first
+#define NK_TEX_WORKER_POOL_FMTS 3
+
+typedef struct NkTexWorkerSet {
+	NkEngine engine;
+	gchar* fmt;
+	GQueue idle;
+} NkTexWorkerSet;
+
+typedef struct NkTexWorkerPool {
+	// per set
+	guint size;
+	// NkTexWorkerSets, most recently used first
+	GQueue sets;
+	guint refill_source;
+} NkTexWorkerPool;
+
+static void nk_tex_worker_free(NkTexWorker* worker) {
+	g_subprocess_force_exit(worker->proc);
+	g_object_unref(worker->proc);
+	nk_rm_dir(worker->dir);
+	g_free(worker->dir);
+	g_free(worker);
+}
+
+static gchar* nk_tex_workspace_new(GError** err) {
+	gchar* dir = g_build_filename(g_get_user_runtime_dir(), "nklatex-XXXXXX", NULL);
+	if (!g_mkdtemp(dir)) {
+		int errsv = errno;
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv), "failed creating workspace %s: %s", dir, g_strerror(errsv));
+		g_free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+/* Starts engine, optionally preloading fmt. If doc_fd is -1 the document is
+ * read from a pipe later written by nk_tex_worker_run_async, otherwise doc_fd
+ * is consumed and read as the document. */
+NkTexWorker* nk_tex_worker_spawn(NkEngine engine, const gchar* fmt, int doc_fd, GError** err) {
+	gchar* dir = nk_tex_workspace_new(err);
+	if (!dir) {
+		if (doc_fd != -1)
+			close(doc_fd);
+		return NULL;
+	}
+
+	GSubprocessFlags flags = G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_MERGE;
+	if (doc_fd == -1)
+		flags |= G_SUBPROCESS_FLAGS_STDIN_PIPE;
+	GSubprocessLauncher* launcher = g_subprocess_launcher_new(flags);
+	g_subprocess_launcher_set_cwd(launcher, dir);
+	nk_tex_launcher_set_limits(launcher);
+	if (doc_fd != -1)
+		g_subprocess_launcher_take_stdin_fd(launcher, doc_fd);
+
+	GPtrArray* argv = g_ptr_array_new_with_free_func(g_free);
+	g_ptr_array_add(argv, g_strdup(nk_engines[engine].program));
+	if (engine == NK_ENGINE_TECTONIC) {
+		g_ptr_array_add(argv, g_strdup("--outfmt=xdv"));
+		g_ptr_array_add(argv, g_strdup("--outdir=."));
+		g_ptr_array_add(argv, g_strdup("-"));
+	} else {
+		if (engine == NK_ENGINE_XELATEX)
+			g_ptr_array_add(argv, g_strdup("-no-pdf"));
+		g_ptr_array_add(argv, g_strdup("-shell-escape"));
+		g_ptr_array_add(argv, g_strdup("-interaction=nonstopmode"));
+		if (fmt)
+			g_ptr_array_add(argv, g_strconcat("-fmt=", fmt, NULL));
+		g_ptr_array_add(argv, g_strconcat("-jobname=", nk_engines[engine].jobname, NULL));
+		// LaTeX's \input would probe (and partially consume) a pipe, use the primitive
+		g_ptr_array_add(argv, g_strdup("\\csname @@input\\endcsname /dev/stdin"));
+	}
+	g_ptr_array_add(argv, NULL);
+
+	GSubprocess* proc = g_subprocess_launcher_spawnv(launcher, (const gchar* const*)argv->pdata, err);
+	g_ptr_array_unref(argv);
+	g_object_unref(launcher);
+	if (!proc) {
+		nk_rm_dir(dir);
+		g_free(dir);
+		return NULL;
+	}
+
+	NkTexWorker* worker = g_new(NkTexWorker, 1);
+	worker->engine = engine;
+	worker->proc = proc;
+	worker->dir = dir;
+	worker->spawned = g_get_monotonic_time();
+	return worker;
+}
+
+/* Spawns a cold worker that reads doc from a memfd right away, for when no
+ * warm worker is available. */
+NkTexWorker* nk_tex_worker_spawn_for(NkEngine engine, const gchar* fmt, const gchar* doc, GError** err) {
+	int fd = memfd_create("latex_doc.tex", MFD_CLOEXEC);
+	if (fd == -1 || write(fd, doc, strlen(doc)) == -1) {
+		int errsv = errno;
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv), "failed writing document to memfd: %s", g_strerror(errsv));
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+	return nk_tex_worker_spawn(engine, fmt, fd, err);
+}
+
+NkTexWorkerPool* nk_tex_worker_pool_get_default(void) {
+	static NkTexWorkerPool* pool = NULL;
+	if (!pool) {
+		pool = g_new0(NkTexWorkerPool, 1);
+		g_queue_init(&pool->sets);
+	}
+	return pool;
+}
+
+static void nk_tex_worker_set_free(NkTexWorkerSet* set) {
+	NkTexWorker* worker;
+	while ((worker = g_queue_pop_head(&set->idle)))
+		nk_tex_worker_free(worker);
+	g_free(set->fmt);
+	g_free(set);
+}
+
+void nk_tex_worker_pool_clear(NkTexWorkerPool* self) {
+	NkTexWorkerSet* set;
+	while ((set = g_queue_pop_head(&self->sets)))
+		nk_tex_worker_set_free(set);
+	if (self->refill_source) {
+		g_source_remove(self->refill_source);
+		self->refill_source = 0;
+	}
+}
+
+static gboolean nk_tex_worker_pool_refill(NkTexWorkerPool* self) {
+	self->refill_source = 0;
+
+	for (GList* l = self->sets.head; l; l = l->next) {
+		NkTexWorkerSet* set = l->data;
+		while (set->idle.length < self->size) {
+			GError* err = NULL;
+			NkTexWorker* worker = nk_tex_worker_spawn(set->engine, set->fmt, -1, &err);
+			if (!worker) {
+				g_warning("failed starting tex worker: %s\n", err->message);
+				g_error_free(err);
+				return G_SOURCE_REMOVE;
+			}
+			g_queue_push_tail(&set->idle, worker);
+		}
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* Marks the set for engine and fmt as most recently used, creating it and
+ * dropping the least recently used one if needed. */
+static NkTexWorkerSet* nk_tex_worker_pool_use(NkTexWorkerPool* self, NkEngine engine, const gchar* fmt, guint size) {
+	self->size = size;
+
+	NkTexWorkerSet* set = NULL;
+	for (GList* l = self->sets.head; l && !set; l = l->next) {
+		NkTexWorkerSet* candidate = l->data;
+		if (candidate->engine == engine && g_str_equal(candidate->fmt, fmt)) {
+			set = candidate;
+			g_queue_delete_link(&self->sets, l);
+		}
+	}
+	if (!set) {
+		set = g_new0(NkTexWorkerSet, 1);
+		set->engine = engine;
+		set->fmt = g_strdup(fmt);
+		g_queue_init(&set->idle);
+	}
+	g_queue_push_head(&self->sets, set);
+	while (self->sets.length > NK_TEX_WORKER_POOL_FMTS)
+		nk_tex_worker_set_free(g_queue_pop_tail(&self->sets));
+
+	for (GList* l = self->sets.head; l; l = l->next) {
+		NkTexWorkerSet* other = l->data;
+		while (other->idle.length > size)
+			nk_tex_worker_free(g_queue_pop_tail(&other->idle));
+	}
+	if (!self->refill_source)
+		self->refill_source = g_idle_add((GSourceFunc)nk_tex_worker_pool_refill, self);
+	return set;
+}
+
+/* Sets up the pool to keep size workers for fmt waiting, started once the
+ * main loop is idle. Workers of the last few other formats are kept too, so
+ * alternating between preambles doesn't throw them away. */
+void nk_tex_worker_pool_prepare(NkTexWorkerPool* self, NkEngine engine, const gchar* fmt, guint size) {
+	if (size == 0) {
+		nk_tex_worker_pool_clear(self);
+		return;
+	}
+	nk_tex_worker_pool_use(self, engine, fmt, size);
+}
+
+/* Takes a warm worker for fmt out of the pool, starting a fresh one if none
+ * is idle. Returns NULL if workers are disabled (size 0). */
+NkTexWorker* nk_tex_worker_pool_acquire(NkTexWorkerPool* self, NkEngine engine, const gchar* fmt, guint size) {
+	if (size == 0) {
+		nk_tex_worker_pool_clear(self);
+		return NULL;
+	}
+
+	NkTexWorkerSet* set = nk_tex_worker_pool_use(self, engine, fmt, size);
+	NkTexWorker* worker = g_queue_pop_head(&set->idle);
+	if (!worker) {
+		GError* err = NULL;
+		worker = nk_tex_worker_spawn(engine, fmt, -1, &err);
+		if (!worker) {
+			g_warning("failed starting tex worker: %s\n", err->message);
+			g_error_free(err);
+		}
+	}
+	return worker;
+}
+
+// pages converted of documents that ship out several
+#define NK_TEX_MAX_PAGES 64
+
+GBytes* nk_svg_stack(GBytes* const* svgs, GBytes* const* bsls, guint n, GBytes** bsl);
+
+typedef struct NkTexJob {
+	NkTexWorker* worker;
+	int svg_fd;
+	GBytes* input;
+	NkTexLog* log;
+
+	// outstanding operations of the xelatex stage (output drained, process exited)
+	guint pending;
+	GError* error;
+
+	NkTexJobFlags flags;
+	gint64 started;
+	gint64 tex_done;
+
+	// running dvisvgm processes, NULL during the TeX stage
+	GPtrArray* dvisvgm;
+	// one result memfd per page, the first being svg_fd
+	int* page_fds;
+	guint pages;
+	guint next_page;
+	gboolean dvisvgm_failed;
+	guint deadline_source;
+	gboolean memory_limited;
+	NkTexLimit limit;
+} NkTexJob;
+
+static void nk_tex_job_free(NkTexJob* job) {
+	if (job->deadline_source)
+		g_source_remove(job->deadline_source);
+	nk_tex_worker_free(job->worker);
+	if (job->svg_fd != -1)
+		close(job->svg_fd);
+	for (guint i = 1; i < job->pages; i++)
+		if (job->page_fds[i] != -1)
+			close(job->page_fds[i]);
+	g_free(job->page_fds);
+	if (job->dvisvgm)
+		g_ptr_array_unref(job->dvisvgm);
+	if (job->input)
+		g_bytes_unref(job->input);
+	nk_tex_log_free(job->log);
+	if (job->error)
+		g_error_free(job->error);
+	g_free(job);
+}
+
+/* Seals the finished result memfd and maps it once; the mapping is then
+ * shared by librsvg, the render cache and the export path. */
+static GBytes* nk_map_fd(int fd, GError** err) {
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+		int errsv = errno;
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv), "failed sealing result: %s", g_strerror(errsv));
+		return NULL;
+	}
+
+	GMappedFile* file = g_mapped_file_new_from_fd(fd, FALSE, err);
+	if (!file)
+		return NULL;
+	GBytes* bytes = g_mapped_file_get_bytes(file);
+	g_mapped_file_unref(file);
+	return bytes;
+}
+
+/* Tells whether proc, started at spawned, was stopped by one of the
+ * rlimits. */
+static NkTexLimit nk_tex_job_limit_hit(NkTexJob* job, GSubprocess* proc, gint64 spawned) {
+	if (!g_subprocess_get_if_signaled(proc))
+		return NK_TEX_LIMIT_NONE;
+	switch (g_subprocess_get_term_sig(proc)) {
+	case SIGXCPU:
+		return NK_TEX_LIMIT_TIME;
+	case SIGKILL:
+		// the hard CPU limit (cpu + 1 seconds) or the kernel's OOM killer. TeX
+		// and dvisvgm are single threaded, so a process that hasn't been
+		// around that long can't have used up its CPU time.
+		if (nk_tex_limits.cpu && g_get_monotonic_time() - spawned >= (gint64)(nk_tex_limits.cpu + 1) * G_USEC_PER_SEC)
+			return NK_TEX_LIMIT_TIME;
+		return NK_TEX_LIMIT_MEMORY;
+	case SIGSEGV:
+	case SIGABRT:
+	case SIGBUS:
+		// what failing allocations usually end in
+		return job->memory_limited ? NK_TEX_LIMIT_MEMORY : NK_TEX_LIMIT_NONE;
+	default:
+		return NK_TEX_LIMIT_NONE;
+	}
+}
+
+static void nk_tex_job_return(GTask* task, gboolean success, GBytes* svg, GBytes* bsl) {
+	NkTexJob* job = g_task_get_task_data(task);
+	if (job->deadline_source) {
+		g_source_remove(job->deadline_source);
+		job->deadline_source = 0;
+	}
+
+	NkTexJobResult* result = g_new0(NkTexJobResult, 1);
+	result->success = success;
+	result->limit = job->limit;
+	result->svg = svg;
+	result->bsl = bsl;
+	result->log = nk_tex_log_get_text(job->log);
+	result->errors = g_ptr_array_ref(job->log->errors);
+	gint64 now = g_get_monotonic_time();
+	if (job->tex_done) {
+		result->engine_time = job->tex_done - job->started;
+		result->dvisvgm_time = now - job->tex_done;
+		nk_stats_span(NK_PHASE_ENGINE, job->started, job->tex_done, NULL);
+		nk_stats_span(NK_PHASE_DVISVGM, job->tex_done, now, NULL);
+	} else {
+		result->engine_time = now - job->started;
+		nk_stats_span(NK_PHASE_ENGINE, job->started, now, NULL);
+	}
+	nk_stats_count(NK_COUNTER_COMPILES);
+	if (!success)
+		nk_stats_count(NK_COUNTER_FAILURES);
+
+	g_task_return_pointer(task, result, (GDestroyNotify)nk_tex_job_result_free);
+	g_object_unref(task);
+}
+
+/* Page count of the DVI or XDV file at path, read from its postamble. 0 if
+ * it isn't one. */
+static guint nk_dvi_page_count(const gchar* path) {
+	GMappedFile* file = g_mapped_file_new(path, FALSE, NULL);
+	if (!file)
+		return 0;
+	const guint8* data = (const guint8*)g_mapped_file_get_contents(file);
+	gsize len = g_mapped_file_get_length(file);
+	guint pages = 0;
+
+	// the file ends in the postamble's offset, the id byte and at least four 223s
+	gsize end = len;
+	while (end > 0 && data[end - 1] == 223)
+		end--;
+	if (end >= 5) {
+		gsize post = (gsize)data[end - 5] << 24 | data[end - 4] << 16 | data[end - 3] << 8 | data[end - 2];
+		// post p[4] num[4] den[4] mag[4] l[4] u[4] s[2] t[2]
+		if (post + 29 <= len && data[post] == 248)
+			pages = data[post + 27] << 8 | data[post + 28];
+	}
+	g_mapped_file_unref(file);
+	return pages;
+}
+
+static void nk_tex_job_dvisvgm_next(GTask* task);
+
+static void nk_tex_worker_dvisvgm_cb(GObject* src, GAsyncResult* res, GTask* task) {
+	NkTexJob* job = g_task_get_task_data(task);
+	g_ptr_array_remove_fast(job->dvisvgm, src);
+
+	GBytes* log = NULL;
+	GError* err = NULL;
+	if (!g_subprocess_communicate_finish(G_SUBPROCESS(src), res, NULL, &log, &err)) {
+		g_subprocess_force_exit(G_SUBPROCESS(src));
+		if (!job->error)
+			job->error = err;
+		else
+			g_error_free(err);
+	} else {
+		if (log) {
+			nk_tex_log_feed_bytes(job->log, log);
+			g_bytes_unref(log);
+		}
+		if (!g_subprocess_get_successful(G_SUBPROCESS(src))) {
+			// the others were killed by us after the first failure
+			if (!job->limit && !job->dvisvgm_failed && !job->error)
+				job->limit = nk_tex_job_limit_hit(job, G_SUBPROCESS(src), *(gint64*)g_object_get_data(src, "nk-spawned"));
+			job->dvisvgm_failed = TRUE;
+		}
+	}
+	g_object_unref(src);
+
+	// one missing page loses the result, don't wait for the others
+	if (job->error || job->dvisvgm_failed) {
+		job->next_page = job->pages;
+		for (guint i = 0; i < job->dvisvgm->len; i++)
+			g_subprocess_force_exit(g_ptr_array_index(job->dvisvgm, i));
+	}
+	nk_tex_job_dvisvgm_next(task);
+	g_object_unref(task);
+}
+
+static void nk_tex_job_dvisvgm_done(GTask* task) {
+	NkTexJob* job = g_task_get_task_data(task);
+	if (job->error) {
+		g_task_return_error(task, job->error);
+		job->error = NULL;
+		g_object_unref(task);
+		return;
+	}
+	if (job->dvisvgm_failed) {
+		nk_tex_job_return(task, FALSE, NULL, NULL);
+		return;
+	}
+
+	GError* err = NULL;
+	GBytes** pages = g_new0(GBytes*, job->pages);
+	for (guint i = 0; i < job->pages && !err; i++)
+		pages[i] = nk_map_fd(job->page_fds[i], &err);
+	GBytes* svg = NULL;
+	if (err) {
+		nk_tex_log_feed(job->log, err->message, strlen(err->message));
+		g_error_free(err);
+	} else if (job->pages == 1) {
+		svg = g_bytes_ref(pages[0]);
+	} else {
+		svg = nk_svg_stack(pages, NULL, job->pages, NULL);
+	}
+	for (guint i = 0; i < job->pages; i++)
+		if (pages[i])
+			g_bytes_unref(pages[i]);
+	g_free(pages);
+	if (!svg) {
+		nk_tex_job_return(task, FALSE, NULL, NULL);
+		return;
+	}
+
+	gchar* bsl_name = g_strconcat(nk_engines[job->worker->engine].jobname, ".bsl", NULL);
+	gchar* bsl_path = g_build_filename(job->worker->dir, bsl_name, NULL);
+	g_free(bsl_name);
+	GBytes* bsl = NULL;
+	gchar* data;
+	gsize len;
+	if (g_file_get_contents(bsl_path, &data, &len, NULL))
+		bsl = g_bytes_new_take(data, len);
+	g_free(bsl_path);
+
+	nk_tex_job_return(task, TRUE, svg, bsl);
+}
+
+static gboolean nk_tex_job_dvisvgm_spawn(GTask* task, guint page, GError** err) {
+	NkTexJob* job = g_task_get_task_data(task);
+	GSubprocessLauncher* launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDERR_PIPE);
+	g_subprocess_launcher_set_cwd(launcher, job->worker->dir);
+	nk_tex_launcher_set_limits(launcher);
+	g_subprocess_launcher_take_stdout_fd(launcher, dup(job->page_fds[page]));
+	const gchar* output = nk_engines[job->worker->engine].output;
+	gchar* page_arg = g_strdup_printf("--page=%u", page + 1);
+	GSubprocess* proc;
+	if (job->flags & NK_TEX_JOB_OPTIMIZE)
+		proc = g_subprocess_launcher_spawn(launcher, err, "dvisvgm", "-n", "-e", "--optimize", "--precision=3", page_arg, "--stdout", output, NULL);
+	else
+		proc = g_subprocess_launcher_spawn(launcher, err, "dvisvgm", "-n1", "-e", page_arg, "--stdout", output, NULL);
+	g_free(page_arg);
+	g_object_unref(launcher);
+	if (!proc)
+		return FALSE;
+
+	gint64 spawned = g_get_monotonic_time();
+	g_object_set_data_full(G_OBJECT(proc), "nk-spawned", g_memdup2(&spawned, sizeof(spawned)), g_free);
+	g_ptr_array_add(job->dvisvgm, proc);
+	g_subprocess_communicate_async(proc, NULL, g_task_get_cancellable(task), (GAsyncReadyCallback)nk_tex_worker_dvisvgm_cb, g_object_ref(task));
+	return TRUE;
+}
+
+/* Keeps this job's share of the cores converting pages until all are done,
+ * so parallel renders don't each start one dvisvgm per core. */
+static void nk_tex_job_dvisvgm_next(GTask* task) {
+	NkTexJob* job = g_task_get_task_data(task);
+	guint cores = g_get_num_processors();
+	guint renders = nk_tex_limits.renders ? MIN(nk_tex_limits.renders, cores) : cores;
+	guint max = MAX(1, cores / renders);
+	while (job->dvisvgm->len < max && job->next_page < job->pages) {
+		GError* err = NULL;
+		if (!nk_tex_job_dvisvgm_spawn(task, job->next_page++, &err)) {
+			if (!job->error)
+				job->error = err;
+			else
+				g_error_free(err);
+			job->next_page = job->pages;
+		}
+	}
+	if (job->dvisvgm->len == 0)
+		nk_tex_job_dvisvgm_done(task);
+}
+
+static void nk_tex_job_tex_done(GTask* task) {
+	NkTexJob* job = g_task_get_task_data(task);
+	job->tex_done = g_get_monotonic_time();
+
+	if (!g_subprocess_get_successful(job->worker->proc)) {
+		if (!job->limit)
+			job->limit = nk_tex_job_limit_hit(job, job->worker->proc, job->worker->spawned);
+		nk_tex_job_return(task, FALSE, NULL, NULL);
+		return;
+	}
+
+	// every page gets its own dvisvgm and result memfd, the first one svg_fd
+	gchar* output = g_build_filename(job->worker->dir, nk_engines[job->worker->engine].output, NULL);
+	guint pages = nk_dvi_page_count(output);
+	g_free(output);
+	if (pages > NK_TEX_MAX_PAGES) {
+		g_warning("only converting the first %d of %u pages\n", NK_TEX_MAX_PAGES, pages);
+		pages = NK_TEX_MAX_PAGES;
+	}
+	job->pages = MAX(pages, 1);
+	job->page_fds = g_new(int, job->pages);
+	job->page_fds[0] = job->svg_fd;
+	for (guint i = 1; i < job->pages; i++)
+		job->page_fds[i] = -1;
+	for (guint i = 1; i < job->pages; i++) {
+		job->page_fds[i] = memfd_create("result.svg", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (job->page_fds[i] == -1) {
+			int errsv = errno;
+			g_task_return_new_error(task, G_FILE_ERROR, g_file_error_from_errno(errsv), "failed creating memfd: %s", g_strerror(errsv));
+			g_object_unref(task);
+			return;
+		}
+	}
+
+	job->dvisvgm = g_ptr_array_new();
+	nk_tex_job_dvisvgm_next(task);
+}
+
+static void nk_tex_job_tex_step(GTask* task, GError* err) {
+	NkTexJob* job = g_task_get_task_data(task);
+
+	if (err && !job->error)
+		job->error = err;
+	else if (err)
+		g_error_free(err);
+
+	if (--job->pending)
+		return;
+
+	if (job->error) {
+		g_task_return_error(task, job->error);
+		job->error = NULL;
+		g_object_unref(task);
+		return;
+	}
+	nk_tex_job_tex_done(task);
+}
+
+static void nk_tex_job_read_cb(GObject* src, GAsyncResult* res, GTask* task) {
+	NkTexJob* job = g_task_get_task_data(task);
+
+	GError* err = NULL;
+	GBytes* bytes = g_input_stream_read_bytes_finish(G_INPUT_STREAM(src), res, &err);
+	if (!bytes) {
+		nk_tex_job_tex_step(task, err);
+		return;
+	}
+	if (g_bytes_get_size(bytes) == 0) {
+		g_bytes_unref(bytes);
+		nk_tex_job_tex_step(task, NULL);
+		return;
+	}
+
+	nk_tex_log_feed_bytes(job->log, bytes);
+	g_bytes_unref(bytes);
+	g_input_stream_read_bytes_async(G_INPUT_STREAM(src), 8192, G_PRIORITY_DEFAULT, g_task_get_cancellable(task), (GAsyncReadyCallback)nk_tex_job_read_cb, task);
+}
+
+static void nk_tex_job_wait_cb(GObject* src, GAsyncResult* res, GTask* task) {
+	GError* err = NULL;
+	g_subprocess_wait_finish(G_SUBPROCESS(src), res, &err);
+	nk_tex_job_tex_step(task, err);
+}
+
+static void nk_tex_job_write_cb(GObject* src, GAsyncResult* res, GTask* task) {
+	// a failed write means xelatex is gone already, which the wait reports
+	g_output_stream_write_all_finish(G_OUTPUT_STREAM(src), res, NULL, NULL);
+	g_output_stream_close(G_OUTPUT_STREAM(src), NULL, NULL);
+	g_object_unref(task);
+}
+
+// kills whatever stage the job is in, which then fails as usual
+static gboolean nk_tex_job_deadline(GTask* task) {
+	NkTexJob* job = g_task_get_task_data(task);
+	job->deadline_source = 0;
+	job->limit = NK_TEX_LIMIT_TIME;
+	g_subprocess_force_exit(job->worker->proc);
+	for (guint i = 0; job->dvisvgm && i < job->dvisvgm->len; i++)
+		g_subprocess_force_exit(g_ptr_array_index(job->dvisvgm, i));
+	return G_SOURCE_REMOVE;
+}
+
+/* Compiles on worker, which is consumed. doc must be given for warm workers
+ * and NULL if the worker was spawned with the document already. */
+void nk_tex_worker_run_async(NkTexWorker* worker, const gchar* doc, NkTexJobFlags flags, GCancellable* cancellable, GAsyncReadyCallback cb, gpointer user_data) {
+	NkTexJob* job = g_new0(NkTexJob, 1);
+	job->worker = worker;
+	job->flags = flags;
+	job->svg_fd = memfd_create("result.svg", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	job->log = nk_tex_log_new();
+	job->pending = 2;
+	job->started = g_get_monotonic_time();
+
+	GTask* task = g_task_new(NULL, cancellable, cb, user_data);
+	g_task_set_task_data(task, job, (GDestroyNotify)nk_tex_job_free);
+	job->memory_limited = nk_tex_limits.memory != 0;
+	if (nk_tex_limits.timeout)
+		job->deadline_source = g_timeout_add_seconds(nk_tex_limits.timeout, (GSourceFunc)nk_tex_job_deadline, task);
+	if (job->svg_fd == -1) {
+		int errsv = errno;
+		g_task_return_new_error(task, G_FILE_ERROR, g_file_error_from_errno(errsv), "failed creating memfd: %s", g_strerror(errsv));
+		g_object_unref(task);
+		return;
+	}
+
+	if (doc) {
+		GOutputStream* input = g_subprocess_get_stdin_pipe(worker->proc);
+		gsize len;
+		job->input = g_bytes_new(doc, strlen(doc));
+		g_output_stream_write_all_async(input, g_bytes_get_data(job->input, &len), len, G_PRIORITY_DEFAULT, cancellable, (GAsyncReadyCallback)nk_tex_job_write_cb, g_object_ref(task));
+	}
+
+	g_input_stream_read_bytes_async(g_subprocess_get_stdout_pipe(worker->proc), 8192, G_PRIORITY_DEFAULT, cancellable, (GAsyncReadyCallback)nk_tex_job_read_cb, task);
+	g_subprocess_wait_async(worker->proc, cancellable, (GAsyncReadyCallback)nk_tex_job_wait_cb, task);
+}
+
+NkTexJobResult* nk_tex_worker_run_finish(GAsyncResult* res, GError** err) {
+	return g_task_propagate_pointer(G_TASK(res), err);
+}
+
+/* Version field of the (usay) NoteKit gets, telling it how to unpack the
+ * payload. zstd gets its own so a NoteKit without it rejects the image
+ * instead of inflating garbage. */
+#define NK_PAYLOAD_ZLIB 2
+#define NK_PAYLOAD_ZSTD 3
+
+/* The payload handed to NoteKit: the uncompressed size as a 4 byte header,
+ * followed by the zlib or zstd compressed svg. level 0 picks the
+ * algorithm's default. */
+GBytes* nk_export_payload_new(GBytes* svg, gboolean zstd, int level, GError** err) {
+	gsize size;
+	const guint8* buffer = g_bytes_get_data(svg, &size);
+	if (size > G_MAXUINT32) {
+		g_set_error(err, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "svg of %" G_GSIZE_FORMAT " bytes too large to export", size);
+		return NULL;
+	}
+	guint32 fsize = (guint32)size;
+
+	guint8* data;
+	gsize len;
+	if (zstd) {
+		size_t cbound = ZSTD_compressBound(size);
+		data = g_new(guint8, cbound+4);
+		size_t ret = ZSTD_compress(&data[4], cbound, buffer, size, level ? level : ZSTD_defaultCLevel());
+		if (ZSTD_isError(ret)) {
+			g_set_error(err, G_IO_ERROR, G_IO_ERROR_FAILED, "failed compressing svg: %s", ZSTD_getErrorName(ret));
+			g_free(data);
+			return NULL;
+		}
+		len = ret;
+	} else {
+		uLongf ret = compressBound(size);
+		data = g_new(guint8, ret+4);
+		int res = compress2(&data[4], &ret, buffer, size, level ? MIN(level, Z_BEST_COMPRESSION) : Z_DEFAULT_COMPRESSION);
+		if (res != Z_OK) {
+			g_set_error(err, G_IO_ERROR, G_IO_ERROR_FAILED, "failed compressing svg: Error %d", res);
+			g_free(data);
+			return NULL;
+		}
+		len = ret;
+	}
+	memcpy(data, &fsize, 4);
+
+	return g_bytes_new_take(g_realloc(data, len+4), len+4);
+}
+
+/* Drops what nothing drawing svg needs: comments, <metadata> and the
+ * whitespace between tags, dvisvgm's output has no text content relying on
+ * it. */
+GBytes* nk_svg_strip(GBytes* svg) {
+	gsize len;
+	const gchar* data = g_bytes_get_data(svg, &len);
+	const gchar* end = data + len;
+	gchar* out = g_malloc(len);
+	gsize out_len = 0;
+
+	const gchar* p = data;
+	while (p < end) {
+		if (*p == '<' && end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+			const gchar* close = g_strstr_len(p + 4, end - p - 4, "-->");
+			p = close ? close + 3 : end;
+			continue;
+		}
+		if (*p == '<' && end - p >= 9 && memcmp(p, "<metadata", 9) == 0) {
+			const gchar* tag_end = memchr(p, '>', end - p);
+			if (tag_end && tag_end[-1] == '/') {
+				p = tag_end + 1;
+				continue;
+			}
+			const gchar* close = g_strstr_len(p, end - p, "</metadata>");
+			p = close ? close + strlen("</metadata>") : end;
+			continue;
+		}
+		if (*p == '>') {
+			out[out_len++] = *p++;
+			const gchar* q = p;
+			while (q < end && g_ascii_isspace(*q))
+				q++;
+			if (q < end && *q == '<')
+				p = q;
+			continue;
+		}
+		out[out_len++] = *p++;
+	}
+
+	return g_bytes_new_take(g_realloc(out, out_len), out_len);
+}
+
+// the value of a metric ("Depth", "Height", ...) in a .bsl in pt, 0 if missing
+static gdouble nk_bsl_get(GBytes* bsl, const gchar* name) {
+	if (!bsl)
+		return 0;
+	gchar* text = g_strndup(g_bytes_get_data(bsl, NULL), g_bytes_get_size(bsl));
+	gchar* prefix = g_strconcat(name, " = ", NULL);
+	gdouble value = 0;
+	for (gchar* line = text; line && *line;) {
+		if (g_str_has_prefix(line, prefix)) {
+			value = g_ascii_strtod(line + strlen(prefix), NULL);
+			break;
+		}
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+	g_free(prefix);
+	g_free(text);
+	return value;
+}
+
+static void nk_svg_append_number(GString* out, gdouble value) {
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+	g_string_append(out, g_ascii_formatd(buf, sizeof(buf), "%.3f", value));
+}
+
+/* Copies the body of a dvisvgm svg (everything after its root tag) to out,
+ * prefixing the ids it defines and references so several can share a
+ * document. */
+static void nk_svg_append_prefixed(GString* out, const gchar* p, const gchar* end, guint block) {
+	static const gchar* const refs[] = { " id='", " id=\"", "href='#", "href=\"#", "url(#" };
+	while (p < end) {
+		gboolean matched = FALSE;
+		for (guint i = 0; i < G_N_ELEMENTS(refs) && !matched; i++) {
+			gsize len = strlen(refs[i]);
+			if ((gsize)(end - p) >= len && memcmp(p, refs[i], len) == 0) {
+				g_string_append_len(out, p, len);
+				g_string_append_printf(out, "b%u-", block);
+				p += len;
+				matched = TRUE;
+			}
+		}
+		if (!matched)
+			g_string_append_c(out, *p++);
+	}
+}
+
+#define NK_SVG_BLOCK_SKIP 6.0
+
+/* Stacks the n block svgs top to bottom into one svg. Every block gets the
+ * height of its box from its .bsl, its ink sitting on the bottom of the box
+ * like the descenders do, with NK_SVG_BLOCK_SKIP pt between blocks. Without
+ * bsls (pages of one document) only the ink is stacked. bsl receives the
+ * metrics of the whole stack, the baseline being the last block's. */
+GBytes* nk_svg_stack(GBytes* const* svgs, GBytes* const* bsls, guint n, GBytes** bsl) {
+	GString* body = g_string_new("");
+	gdouble width = 0;
+	gdouble y = 0;
+	gdouble depth = 0;
+
+	for (guint i = 0; i < n; i++) {
+		gsize len;
+		const gchar* data = g_bytes_get_data(svgs[i], &len);
+		const gchar* end = data + len;
+		const gchar* root = g_strstr_len(data, len, "<svg");
+		const gchar* root_end = root ? memchr(root, '>', end - root) : NULL;
+		if (!root_end)
+			continue;
+
+		gdouble box[4] = { 0 };
+		gchar* tag = g_strndup(root, root_end - root);
+		const gchar* view_box = strstr(tag, "viewBox=");
+		if (view_box) {
+			gchar* c = (gchar*)view_box + strlen("viewBox=") + 1;
+			for (guint j = 0; j < 4; j++)
+				box[j] = g_ascii_strtod(c, &c);
+		}
+		g_free(tag);
+
+		gdouble ink = box[3];
+		GBytes* metrics = bsls ? bsls[i] : NULL;
+		gdouble total = MAX(nk_bsl_get(metrics, "TotalHeight"), ink);
+		if (i)
+			y += NK_SVG_BLOCK_SKIP;
+
+		g_string_append(body, "<svg x='0' y='");
+		nk_svg_append_number(body, y + total - ink);
+		g_string_append(body, "' width='");
+		nk_svg_append_number(body, box[2]);
+		g_string_append(body, "' height='");
+		nk_svg_append_number(body, box[3]);
+		g_string_append(body, "' viewBox='");
+		for (guint j = 0; j < 4; j++) {
+			if (j)
+				g_string_append_c(body, ' ');
+			nk_svg_append_number(body, box[j]);
+		}
+		g_string_append(body, "'>");
+		nk_svg_append_prefixed(body, root_end + 1, end, i);
+
+		y += total;
+		width = MAX(width, MAX(box[2], nk_bsl_get(metrics, "Width")));
+		depth = nk_bsl_get(metrics, "Depth");
+	}
+
+	GString* out = g_string_new("<?xml version='1.0' encoding='UTF-8'?>\n"
+		"<svg version='1.1' xmlns='http://www.w3.org/2000/svg' xmlns:xlink='http://www.w3.org/1999/xlink' width='");
+	nk_svg_append_number(out, width);
+	g_string_append(out, "pt' height='");
+	nk_svg_append_number(out, y);
+	g_string_append(out, "pt' viewBox='0 0 ");
+	nk_svg_append_number(out, width);
+	g_string_append_c(out, ' ');
+	nk_svg_append_number(out, y);
+	g_string_append(out, "'>\n");
+	g_string_append_len(out, body->str, body->len);
+	g_string_append(out, "</svg>\n");
+	g_string_free(body, TRUE);
+
+	if (bsl) {
+		gchar depth_s[G_ASCII_DTOSTR_BUF_SIZE], height_s[G_ASCII_DTOSTR_BUF_SIZE], total_s[G_ASCII_DTOSTR_BUF_SIZE], width_s[G_ASCII_DTOSTR_BUF_SIZE];
+		gchar* text = g_strdup_printf("Depth = %spt\nHeight = %spt\nTotalHeight = %spt\nWidth = %spt\n",
+			g_ascii_formatd(depth_s, sizeof(depth_s), "%.5f", depth),
+			g_ascii_formatd(height_s, sizeof(height_s), "%.5f", y - depth),
+			g_ascii_formatd(total_s, sizeof(total_s), "%.5f", y),
+			g_ascii_formatd(width_s, sizeof(width_s), "%.5f", width));
+		*bsl = g_bytes_new_take(text, strlen(text));
+	}
+
+	gsize out_len = out->len;
+	return g_bytes_new_take(g_string_free(out, FALSE), out_len);
+}
+
+typedef struct NkExportPayloadData {
+	GBytes* svg;
+	gboolean optimize;
+	gboolean zstd;
+	int level;
+} NkExportPayloadData;
+static void nk_export_payload_data_free(NkExportPayloadData* data) {
+	g_bytes_unref(data->svg);
+	g_free(data);
+}
+
+static void nk_export_payload_thread(GTask* task, gpointer, NkExportPayloadData* data, GCancellable*) {
+	GError* err = NULL;
+	GBytes* svg = g_bytes_ref(data->svg);
+	if (data->optimize) {
+		gint64 begin = g_get_monotonic_time();
+		g_bytes_unref(svg);
+		svg = nk_svg_strip(data->svg);
+
+		// dvisvgm already optimized data->svg, this is only the stripping
+		gchar* detail = g_strdup_printf("stripped %" G_GSIZE_FORMAT " -> %" G_GSIZE_FORMAT " bytes", g_bytes_get_size(data->svg), g_bytes_get_size(svg));
+		nk_stats_span(NK_PHASE_OPTIMIZE, begin, g_get_monotonic_time(), detail);
+		g_free(detail);
+	}
+	GBytes* payload = nk_export_payload_new(svg, data->zstd, data->level, &err);
+	g_bytes_unref(svg);
+	if (payload)
+		g_task_return_pointer(task, payload, (GDestroyNotify)g_bytes_unref);
+	else
+		g_task_return_error(task, err);
+}
+
+/* Like nk_export_payload_new() in a thread, running svg through
+ * nk_svg_strip() first if optimize is set. */
+void nk_export_payload_new_async(GBytes* svg, gboolean optimize, gboolean zstd, int level, GCancellable* cancellable, GAsyncReadyCallback cb, gpointer user_data) {
+	NkExportPayloadData* data = g_new(NkExportPayloadData, 1);
+	data->svg = g_bytes_ref(svg);
+	data->optimize = optimize;
+	data->zstd = zstd;
+	data->level = level;
+
+	GTask* task = g_task_new(NULL, cancellable, cb, user_data);
+	g_task_set_task_data(task, data, (GDestroyNotify)nk_export_payload_data_free);
+	g_task_run_in_thread(task, (GTaskThreadFunc)nk_export_payload_thread);
+	g_object_unref(task);
+}
+
+GBytes* nk_export_payload_new_finish(GAsyncResult* res, GError** err) {
+	return g_task_propagate_pointer(G_TASK(res), err);
+}
+
+/* Sidecars.
+ *
+ * The LaTeX source of a widget lives next to its note, which may well be on a
+ * network mount, so it is only ever touched asynchronously. Saving replaces
+ * the file atomically (GIO writes a temporary file and renames it over the
+ * old one), a crash mid-save leaves the previous source intact.
+ */
+static void nk_sidecar_replaced(GObject* src, GAsyncResult* res, GTask* task) {
+	GError* err = NULL;
+	if (g_file_replace_contents_finish(G_FILE(src), res, NULL, &err))
+		g_task_return_boolean(task, TRUE);
+	else
+		g_task_return_error(task, err);
+	g_object_unref(task);
+}
+
+static void nk_sidecar_dir_created(GObject* src, GAsyncResult* res, GTask* task) {
+	GError* err = NULL;
+	if (!g_file_make_directory_finish(G_FILE(src), res, &err)) {
+		if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_EXISTS)) {
+			g_task_return_error(task, err);
+			g_object_unref(task);
+			return;
+		}
+		g_error_free(err);
+	}
+	g_file_replace_contents_bytes_async(G_FILE(g_task_get_source_object(task)), g_task_get_task_data(task), NULL, FALSE, G_FILE_CREATE_NONE,
+		g_task_get_cancellable(task), (GAsyncReadyCallback)nk_sidecar_replaced, task);
+}
+
+/* Writes data to path next to the sidecars, creating their directory. */
+void nk_sidecar_save_bytes_async(const gchar* path, GBytes* data, GCancellable* cancellable, GAsyncReadyCallback cb, gpointer user_data) {
+	GFile* file = g_file_new_for_path(path);
+	GTask* task = g_task_new(file, cancellable, cb, user_data);
+	g_task_set_source_tag(task, nk_sidecar_save_bytes_async);
+	g_task_set_task_data(task, g_bytes_ref(data), (GDestroyNotify)g_bytes_unref);
+
+	GFile* dir = g_file_get_parent(file);
+	g_file_make_directory_async(dir, G_PRIORITY_DEFAULT, cancellable, (GAsyncReadyCallback)nk_sidecar_dir_created, task);
+	g_object_unref(dir);
+	g_object_unref(file);
+}
+
+/* Writes tex (taken) to the sidecar at path, creating its directory. */
+void nk_sidecar_save_async(const gchar* path, gchar* tex, GCancellable* cancellable, GAsyncReadyCallback cb, gpointer user_data) {
+	GBytes* data = g_bytes_new_take(tex, strlen(tex));
+	nk_sidecar_save_bytes_async(path, data, cancellable, cb, user_data);
+	g_bytes_unref(data);
+}
+
+gboolean nk_sidecar_save_finish(GAsyncResult* res, GError** err) {
+	return g_task_propagate_boolean(G_TASK(res), err);
+}
+
+/* Raster renditions.
+ *
+ * Complex svgs are expensive to draw for NoteKit on every redraw, so next to
+ * the svg payload PNGs of the same handle can be saved at the scale factors
+ * in export-png-scales, as <sidecar>@<scale>x.png. Consumers pick whichever
+ * is cheapest for them.
+ */
+typedef struct NkRendition {
+	int scale;
+	GBytes* png;
+	// microseconds spent rasterizing and encoding
+	gint64 encode_time;
+} NkRendition;
+
+void nk_rendition_free(NkRendition* rendition) {
+	g_bytes_unref(rendition->png);
+	g_free(rendition);
+}
+
+/* Renders handle at its natural size times scale. Safe to call from any
+ * thread. */
+NkRendition* nk_rendition_new(RsvgHandle* handle, int scale) {
+	RsvgRectangle geometry;
+	G_LOCK(nk_rsvg);
+	rsvg_handle_get_intrinsic_dimensions(handle, NULL, NULL, NULL, NULL, NULL, &geometry);
+	G_UNLOCK(nk_rsvg);
+
+	gint64 begin = g_get_monotonic_time();
+	GdkTexture* texture = nk_latex_svg_rasterize(handle, &geometry, 2*(geometry.x + geometry.width), 2*geometry.y + geometry.height, scale);
+	NkRendition* rendition = g_new(NkRendition, 1);
+	rendition->scale = scale;
+	rendition->png = gdk_texture_save_to_png_bytes(texture);
+	g_object_unref(texture);
+	gint64 end = g_get_monotonic_time();
+	rendition->encode_time = end - begin;
+
+	gchar* detail = g_strdup_printf("png @%dx, %" G_GSIZE_FORMAT " bytes", scale, g_bytes_get_size(rendition->png));
+	nk_stats_span(NK_PHASE_ENCODE, begin, end, detail);
+	g_free(detail);
+	return rendition;
+}
+
+gchar* nk_rendition_path(const gchar* sidecar, int scale) {
+	gsize len = strlen(sidecar);
+	if (g_str_has_suffix(sidecar, ".tex"))
+		len -= strlen(".tex");
+	return g_strdup_printf("%.*s@%dx.png", (int)len, sidecar, scale);
+}
+
+#define NK_RENDITION_SCALE_MAX 16
+
+/* Reads export-png-scales, dropping scales outside 1..NK_RENDITION_SCALE_MAX.
+ * The key itself has no range, anything written to dconf ends up here. */
+GArray* nk_rendition_scales(GSettings* settings) {
+	GArray* scales = g_array_new(FALSE, FALSE, sizeof(gint32));
+	GVariant* value = g_settings_get_value(settings, "export-png-scales");
+	GVariantIter iter;
+	gint32 scale;
+	g_variant_iter_init(&iter, value);
+	while (g_variant_iter_next(&iter, "i", &scale)) {
+		if (scale >= 1 && scale <= NK_RENDITION_SCALE_MAX)
+			g_array_append_val(scales, scale);
+		else
+			g_warning("ignoring export-png-scales entry %d\n", scale);
+	}
+	g_variant_unref(value);
+	return scales;
+}
+
+typedef struct NkRenditionsData {
+	RsvgHandle* handle;
+	GArray* scales;
+} NkRenditionsData;
+static void nk_renditions_data_free(NkRenditionsData* data) {
+	g_object_unref(data->handle);
+	g_array_unref(data->scales);
+	g_free(data);
+}
+
+static void nk_renditions_thread(GTask* task, gpointer, NkRenditionsData* data, GCancellable*) {
+	GPtrArray* renditions = g_ptr_array_new_with_free_func((GDestroyNotify)nk_rendition_free);
+	for (guint i = 0; i < data->scales->len; i++)
+		g_ptr_array_add(renditions, nk_rendition_new(data->handle, g_array_index(data->scales, gint32, i)));
+	g_task_return_pointer(task, renditions, (GDestroyNotify)g_ptr_array_unref);
+}
+
+/* Renders handle at every scale in scales (gint32) off the main thread. */
+void nk_renditions_new_async(RsvgHandle* handle, GArray* scales, GCancellable* cancellable, GAsyncReadyCallback cb, gpointer user_data) {
+	NkRenditionsData* data = g_new(NkRenditionsData, 1);
+	data->handle = g_object_ref(handle);
+	data->scales = g_array_ref(scales);
+
+	GTask* task = g_task_new(NULL, cancellable, cb, user_data);
+	g_task_set_task_data(task, data, (GDestroyNotify)nk_renditions_data_free);
+	g_task_run_in_thread(task, (GTaskThreadFunc)nk_renditions_thread);
+	g_object_unref(task);
+}
+
+GPtrArray* nk_renditions_new_finish(GAsyncResult* res, GError** err) {
+	return g_task_propagate_pointer(G_TASK(res), err);
+}
+
+static void nk_renditions_saved(GObject*, GAsyncResult* res, gpointer) {
+	GError* err = NULL;
+	if (!nk_sidecar_save_finish(res, &err)) {
+		g_warning("failed saving rendition: %s\n", err->message);
+		g_error_free(err);
+	}
+}
+
+static void nk_renditions_export_cb(GObject*, GAsyncResult* res, gchar* sidecar) {
+	GPtrArray* renditions = nk_renditions_new_finish(res, NULL);
+	for (guint i = 0; renditions && i < renditions->len; i++) {
+		NkRendition* rendition = g_ptr_array_index(renditions, i);
+		gchar* path = nk_rendition_path(sidecar, rendition->scale);
+		g_debug("rendition %s: %" G_GINT64_FORMAT " us, %" G_GSIZE_FORMAT " bytes\n", path, rendition->encode_time, g_bytes_get_size(rendition->png));
+		nk_sidecar_save_bytes_async(path, rendition->png, NULL, nk_renditions_saved, NULL);
+		g_free(path);
+	}
+	if (renditions)
+		g_ptr_array_unref(renditions);
+	g_free(sidecar);
+}
+
+/* Saves the renditions export-png-scales asks for next to sidecar. */
+void nk_renditions_export(GSettings* settings, RsvgHandle* handle, const gchar* sidecar) {
+	if (!handle)
+		return;
+	GArray* scales = nk_rendition_scales(settings);
+	if (scales->len)
+		nk_renditions_new_async(handle, scales, NULL, (GAsyncReadyCallback)nk_renditions_export_cb, g_strdup(sidecar));
+	g_array_unref(scales);
+}
+
+/* Batch rendering, without any UI.
+ *
+ * Sources are either widget sidecars, <note_dir>/.<appid>/<note>~<uuid>.tex,
+ * whose results get pushed to NoteKit through update_nke, or plain .tex
+ * bodies rendered to an svg file. Either way they are compiled with up to
+ * jobs cold workers at once.
+ */
+typedef struct NkBatch {
+	GSettings* settings;
+	GDBusConnection* con;
+	GQueue pending;
+	guint running;
+	guint jobs;
+	guint total;
+	guint failed;
+	// print per-phase timings instead of delivering results
+	gboolean benchmark;
+	// run the benchmark stages without printing anything
+	gboolean quiet;
+	// payloads are zstd compressed, fixed for the run
+	gboolean zstd;
+	GMainLoop* loop;
+} NkBatch;
+
+typedef struct NkBatchItem {
+	NkBatch* batch;
+	gchar* path;
+	// read from path if NULL
+	gchar* input;
+	// NULL to send to NoteKit as widget, "-" for stdout
+	gchar* output;
+	GVariant* widget;
+	gint input_line;
+	NkEngine engine;
+	gint64 document_time;
+	// benchmarks with optimize-svg compile doc again without any optimization
+	// as the baseline, the optimized result waits for it
+	gchar* doc;
+	gchar* fmt;
+	NkTexJobResult* optimized;
+} NkBatchItem;
+static void nk_batch_item_free(NkBatchItem* item) {
+	if (item->optimized)
+		nk_tex_job_result_free(item->optimized);
+	g_free(item->fmt);
+	g_free(item->doc);
+	if (item->widget)
+		g_variant_unref(item->widget);
+	g_free(item->output);
+	g_free(item->input);
+	g_free(item->path);
+	g_free(item);
+}
+
+NkBatch* nk_batch_new(GSettings* settings, guint jobs) {
+	NkBatch* self = g_new0(NkBatch, 1);
+	self->settings = g_object_ref(settings);
+	self->jobs = jobs ? jobs : g_get_num_processors();
+	self->zstd = g_settings_get_boolean(settings, "export-zstd");
+	nk_tex_limits_load(settings);
+	nk_tex_limits.renders = self->jobs;
+	g_queue_init(&self->pending);
+	return self;
+}
+
+void nk_batch_free(NkBatch* self) {
+	g_queue_clear_full(&self->pending, (GDestroyNotify)nk_batch_item_free);
+	g_clear_object(&self->con);
+	g_object_unref(self->settings);
+	g_free(self);
+}
+
+/* Derives the (note, uuid) widget id insert_nke_cb stored the sidecar for. */
+static GVariant* nk_batch_widget_for(const gchar* path) {
+	gchar* name = g_path_get_basename(path);
+	gchar* sidecar_dir = g_path_get_dirname(path);
+	gchar* note_dir = g_path_get_dirname(sidecar_dir);
+	GVariant* widget = NULL;
+
+	gchar* sep = strrchr(name, '~');
+	if (sep && g_str_has_suffix(sep, ".tex")) {
+		gchar* uuid = sep+1;
+		*sep = 0x0;
+		uuid[strlen(uuid) - strlen(".tex")] = 0x0;
+
+		gchar* note = g_strdup_printf("%s/%s.md", note_dir, name);
+		widget = g_variant_ref_sink(g_variant_new("(ss)", note, uuid));
+		g_free(note);
+	}
+
+	g_free(note_dir);
+	g_free(sidecar_dir);
+	g_free(name);
+	return widget;
+}
+
+static void nk_batch_collect(NkBatch* self, const gchar* path, gboolean sidecars) {
+	if (!g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		if (!sidecars || !g_str_has_suffix(path, ".tex"))
+			return;
+		GVariant* widget = nk_batch_widget_for(path);
+		if (!widget) {
+			g_warning("%s is not a widget source\n", path);
+			return;
+		}
+		NkBatchItem* item = g_new0(NkBatchItem, 1);
+		item->batch = self;
+		item->path = g_strdup(path);
+		item->widget = widget;
+		g_queue_push_tail(&self->pending, item);
+		return;
+	}
+
+	GError* err = NULL;
+	GDir* dir = g_dir_open(path, 0, &err);
+	if (!dir) {
+		g_warning("failed opening %s: %s\n", path, err->message);
+		g_error_free(err);
+		return;
+	}
+	const gchar* name;
+	while ((name = g_dir_read_name(dir))) {
+		gboolean is_sidecars = g_str_equal(name, "." APPL_ID);
+		// don't descend into .git and friends
+		if (name[0] == '.' && !is_sidecars)
+			continue;
+		gchar* child = g_build_filename(path, name, NULL);
+		nk_batch_collect(self, child, sidecars || is_sidecars);
+		g_free(child);
+	}
+	g_dir_close(dir);
+}
+
+/* Queues all widget sources of a note, notebook or single sidecar. */
+void nk_batch_add_widgets(NkBatch* self, const gchar* path) {
+	gchar* dir = g_path_get_dirname(path);
+	gchar* dir_name = g_path_get_basename(dir);
+	nk_batch_collect(self, path, g_str_equal(dir_name, "." APPL_ID));
+	g_free(dir_name);
+	g_free(dir);
+}
+
+/* Queues rendering the body read from path, or input if that isn't NULL,
+ * into the svg file output. */
+void nk_batch_add_file(NkBatch* self, const gchar* path, gchar* input, const gchar* output) {
+	NkBatchItem* item = g_new0(NkBatchItem, 1);
+	item->batch = self;
+	item->path = g_strdup(path);
+	item->input = input;
+	item->output = g_strdup(output);
+	g_queue_push_tail(&self->pending, item);
+}
+
+static gint nk_batch_path_cmp(const gchar** a, const gchar** b) {
+	return strcmp(*a, *b);
+}
+
+/* Queues the .tex files in path, or path itself, for benchmarking. */
+void nk_batch_add_benchmark(NkBatch* self, const gchar* path) {
+	self->benchmark = TRUE;
+	if (!g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		nk_batch_add_file(self, path, NULL, NULL);
+		return;
+	}
+
+	GError* err = NULL;
+	GDir* dir = g_dir_open(path, 0, &err);
+	if (!dir) {
+		g_warning("failed opening %s: %s\n", path, err->message);
+		g_error_free(err);
+		return;
+	}
+	GPtrArray* names = g_ptr_array_new_with_free_func(g_free);
+	const gchar* name;
+	while ((name = g_dir_read_name(dir)))
+		if (g_str_has_suffix(name, ".tex"))
+			g_ptr_array_add(names, g_build_filename(path, name, NULL));
+	g_dir_close(dir);
+
+	// stable order, so runs can be compared line by line
+	g_ptr_array_sort(names, (GCompareFunc)nk_batch_path_cmp);
+	for (guint i = 0; i < names->len; i++)
+		nk_batch_add_file(self, g_ptr_array_index(names, i), NULL, NULL);
+	g_ptr_array_unref(names);
+}
+
+static void nk_batch_next(NkBatch* self);
+
+static gboolean nk_batch_item_load(NkBatchItem* item) {
+	GError* err = NULL;
+	if (!item->input && !g_file_get_contents(item->path, &item->input, NULL, &err)) {
+		g_warning("failed reading %s: %s\n", item->path, err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void nk_batch_item_finish(NkBatchItem* item, gboolean success) {
+	NkBatch* self = item->batch;
+	if (!success)
+		self->failed++;
+	self->running--;
+	nk_batch_item_free(item);
+}
+
+static void nk_batch_item_done(NkBatchItem* item, gboolean success) {
+	NkBatch* self = item->batch;
+	nk_batch_item_finish(item, success);
+	nk_batch_next(self);
+}
+
+/* Runs the remaining stages of an interactive render and export on a
+ * finished job and prints how long each took as one line of JSON. If the job
+ * was optimized, unoptimized is the same document compiled without, and the
+ * unoptimized_ figures are what dvisvgm and compression did on that. */
+static gboolean nk_batch_benchmark(NkBatchItem* item, NkTexJobResult* result, NkTexJobResult* unoptimized) {
+	GSettings* settings = item->batch->settings;
+	GError* err = NULL;
+	gint64 start;
+
+	start = g_get_monotonic_time();
+	RsvgHandle* handle = nk_svg_handle_new(result->svg, &err);
+	gint64 parse_time = g_get_monotonic_time() - start;
+	if (!handle) {
+		g_warning("failed parsing %s: %s\n", item->path, err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+
+	// at the size NkLatexSvgArea asks for, on a HiDPI screen
+	RsvgRectangle geometry;
+	rsvg_handle_get_intrinsic_dimensions(handle, NULL, NULL, NULL, NULL, NULL, &geometry);
+	start = g_get_monotonic_time();
+	GdkTexture* texture = nk_latex_svg_rasterize(handle, &geometry, 2*(geometry.x + geometry.width), 2*geometry.y + geometry.height, 2);
+	gint64 rasterize_time = g_get_monotonic_time() - start;
+	g_object_unref(texture);
+
+	GString* renditions = g_string_new("");
+	GArray* scales = nk_rendition_scales(settings);
+	for (guint i = 0; i < scales->len; i++) {
+		gint32 scale = g_array_index(scales, gint32, i);
+		NkRendition* rendition = nk_rendition_new(handle, scale);
+		g_string_append_printf(renditions, "%s{\"scale\": %d, \"encode_us\": %" G_GINT64_FORMAT ", \"bytes\": %" G_GSIZE_FORMAT "}",
+			renditions->len ? ", " : "", scale, rendition->encode_time, g_bytes_get_size(rendition->png));
+		nk_rendition_free(rendition);
+	}
+	g_array_unref(scales);
+	g_object_unref(handle);
+
+	GBytes* svg = g_bytes_ref(result->svg);
+	gint64 strip_time = 0;
+	if (unoptimized) {
+		start = g_get_monotonic_time();
+		g_bytes_unref(svg);
+		svg = nk_svg_strip(result->svg);
+		strip_time = g_get_monotonic_time() - start;
+	}
+
+	gboolean zstd = g_settings_get_boolean(settings, "export-zstd");
+	int level = g_settings_get_int(settings, "export-level");
+	gsize unoptimized_payload_size = 0;
+	if (unoptimized) {
+		GBytes* unoptimized_payload = nk_export_payload_new(unoptimized->svg, zstd, level, NULL);
+		if (unoptimized_payload) {
+			unoptimized_payload_size = g_bytes_get_size(unoptimized_payload);
+			g_bytes_unref(unoptimized_payload);
+		}
+	}
+
+	start = g_get_monotonic_time();
+	GBytes* payload = nk_export_payload_new(svg, zstd, level, &err);
+	gint64 compress_time = g_get_monotonic_time() - start;
+	if (!payload) {
+		g_warning("%s: %s\n", item->path, err->message);
+		g_error_free(err);
+		g_bytes_unref(svg);
+		g_string_free(renditions, TRUE);
+		return FALSE;
+	}
+
+	start = g_get_monotonic_time();
+	GVariant* msg = g_variant_ref_sink(g_variant_new("(us@ay)", zstd ? NK_PAYLOAD_ZSTD : NK_PAYLOAD_ZLIB, "image/svg+xml", g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, payload, TRUE)));
+	// forces serialization, as sending it would
+	g_variant_get_data(msg);
+	gint64 payload_time = g_get_monotonic_time() - start;
+	gsize payload_size = g_variant_get_size(msg);
+	gsize compressed_size = g_bytes_get_size(payload);
+	g_variant_unref(msg);
+	g_bytes_unref(payload);
+	if (!unoptimized) {
+		unoptimized = result;
+		unoptimized_payload_size = compressed_size;
+	}
+
+	if (item->batch->quiet) {
+		g_bytes_unref(svg);
+		g_string_free(renditions, TRUE);
+		return TRUE;
+	}
+
+	gchar* name = g_path_get_basename(item->path);
+	gchar* ename = g_strescape(name, NULL);
+	g_print("{\"name\": \"%s\", \"engine\": \"%s\", \"document_us\": %" G_GINT64_FORMAT ", \"engine_us\": %" G_GINT64_FORMAT
+		", \"unoptimized_dvisvgm_us\": %" G_GINT64_FORMAT ", \"dvisvgm_us\": %" G_GINT64_FORMAT
+		", \"parse_us\": %" G_GINT64_FORMAT ", \"rasterize_us\": %" G_GINT64_FORMAT ", \"strip_us\": %" G_GINT64_FORMAT ", \"compress_us\": %" G_GINT64_FORMAT ", \"payload_us\": %" G_GINT64_FORMAT
+		", \"unoptimized_bytes\": %" G_GSIZE_FORMAT ", \"dvisvgm_bytes\": %" G_GSIZE_FORMAT ", \"svg_bytes\": %" G_GSIZE_FORMAT
+		", \"unoptimized_compressed_bytes\": %" G_GSIZE_FORMAT ", \"compressed_bytes\": %" G_GSIZE_FORMAT ", \"payload_bytes\": %" G_GSIZE_FORMAT ", \"renditions\": [%s]}\n",
+		ename, nk_engines[item->engine].name, item->document_time, result->engine_time,
+		unoptimized->dvisvgm_time, result->dvisvgm_time,
+		parse_time, rasterize_time, strip_time, compress_time, payload_time,
+		g_bytes_get_size(unoptimized->svg), g_bytes_get_size(result->svg), g_bytes_get_size(svg),
+		unoptimized_payload_size, compressed_size, payload_size, renditions->str);
+	g_string_free(renditions, TRUE);
+	g_bytes_unref(svg);
+	g_free(ename);
+	g_free(name);
+	return TRUE;
+}
+
+static void nk_batch_sent_cb(GObject* src, GAsyncResult* res, NkBatchItem* item) {
+	GError* err = NULL;
+	GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(src), res, &err);
+	if (!ret) {
+		g_warning("failed sending %s to NoteKit: %s\n", item->path, err->message);
+		g_error_free(err);
+		nk_batch_item_done(item, FALSE);
+		return;
+	}
+	g_variant_unref(ret);
+	nk_batch_item_done(item, TRUE);
+}
+
+static void nk_batch_payload_cb(GObject*, GAsyncResult* res, NkBatchItem* item) {
+	GError* err = NULL;
+	GBytes* payload = nk_export_payload_new_finish(res, &err);
+	if (!payload) {
+		g_warning("%s: %s\n", item->path, err->message);
+		g_error_free(err);
+		nk_batch_item_done(item, FALSE);
+		return;
+	}
+
+	g_dbus_connection_call(item->batch->con,
+		"com.github.blackhole89.notekit",
+		"/com/github/blackhole89/NoteKit/Notebook/1",
+		"com.github.blackhole89.NoteKit.Notebook",
+		"update_nke",
+		g_variant_new("(@(ss)@(usay))",
+			item->widget,
+			g_variant_new("(us@ay)", item->batch->zstd ? NK_PAYLOAD_ZSTD : NK_PAYLOAD_ZLIB, "image/svg+xml", g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, payload, TRUE))
+		),
+		NULL,
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		NULL,
+		(GAsyncReadyCallback)nk_batch_sent_cb,
+		item
+	);
+	g_bytes_unref(payload);
+}
+
+static gboolean nk_batch_write(NkBatchItem* item, GBytes* svg) {
+	gsize len;
+	const gchar* data = g_bytes_get_data(svg, &len);
+
+	if (g_str_equal(item->output, "-")) {
+		if (fwrite(data, 1, len, stdout) != len || fflush(stdout) != 0) {
+			g_warning("failed writing %s to stdout: %s\n", item->path, g_strerror(errno));
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	GError* err = NULL;
+	if (!g_file_set_contents(item->output, data, len, &err)) {
+		g_warning("failed writing %s: %s\n", item->output, err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void nk_batch_result_cb(GObject*, GAsyncResult* res, NkBatchItem* item) {
+	GError* err = NULL;
+	NkTexJobResult* result = nk_tex_worker_run_finish(res, &err);
+	if (!result) {
+		g_warning("failed rendering %s: %s\n", item->path, err->message);
+		g_error_free(err);
+		nk_batch_item_done(item, FALSE);
+		return;
+	}
+	if (!result->success) {
+		if (result->limit) {
+			g_warning("failed rendering %s: %s\n", item->path, result->limit == NK_TEX_LIMIT_TIME ? "timed out" : "out of memory");
+		} else if (result->errors->len) {
+			NkTexError* error = g_ptr_array_index(result->errors, 0);
+			gint line = error->line >= item->input_line ? error->line - item->input_line + 1 : 0;
+			g_warning("failed rendering %s:%d: %s\n", item->path, line, error->message);
+		} else {
+			g_warning("failed rendering %s\n", item->path);
+		}
+		nk_tex_job_result_free(result);
+		nk_batch_item_done(item, FALSE);
+		return;
+	}
+
+	if (item->batch->benchmark) {
+		if (item->doc && !item->optimized) {
+			item->optimized = result;
+			NkTexWorker* worker = nk_tex_worker_spawn_for(item->engine, item->fmt, item->doc, &err);
+			if (!worker) {
+				g_warning("Failed launching %s: %s\n", nk_engines[item->engine].program, err->message);
+				g_error_free(err);
+				nk_batch_item_done(item, FALSE);
+				return;
+			}
+			nk_tex_worker_run_async(worker, NULL, NK_TEX_JOB_NONE, NULL, (GAsyncReadyCallback)nk_batch_result_cb, item);
+			return;
+		}
+		gboolean success = item->optimized ? nk_batch_benchmark(item, item->optimized, result) : nk_batch_benchmark(item, result, NULL);
+		nk_tex_job_result_free(result);
+		nk_batch_item_done(item, success);
+		return;
+	}
+	if (item->output) {
+		gboolean success = nk_batch_write(item, result->svg);
+		nk_tex_job_result_free(result);
+		nk_batch_item_done(item, success);
+		return;
+	}
+
+	GSettings* settings = item->batch->settings;
+	RsvgHandle* handle = nk_svg_handle_new(result->svg, NULL);
+	if (handle) {
+		// written synchronously, the batch may quit before async saves land
+		GArray* scales = nk_rendition_scales(settings);
+		for (guint i = 0; i < scales->len; i++) {
+			gint32 scale = g_array_index(scales, gint32, i);
+			NkRendition* rendition = nk_rendition_new(handle, scale);
+			gchar* path = nk_rendition_path(item->path, scale);
+			GError* err = NULL;
+			if (!g_file_set_contents(path, g_bytes_get_data(rendition->png, NULL), g_bytes_get_size(rendition->png), &err)) {
+				g_warning("failed saving rendition: %s\n", err->message);
+				g_error_free(err);
+			}
+			g_free(path);
+			nk_rendition_free(rendition);
+		}
+		g_array_unref(scales);
+		g_object_unref(handle);
+	}
+	nk_export_payload_new_async(result->svg, g_settings_get_boolean(settings, "optimize-svg"), item->batch->zstd, g_settings_get_int(settings, "export-level"), NULL, (GAsyncReadyCallback)nk_batch_payload_cb, item);
+	nk_tex_job_result_free(result);
+}
+
+static void nk_batch_next(NkBatch* self) {
+	NkBatchItem* item;
+	while (self->running < self->jobs && (item = g_queue_pop_head(&self->pending))) {
+		self->running++;
+
+		GError* err = NULL;
+		if (!nk_batch_item_load(item)) {
+			nk_batch_item_finish(item, FALSE);
+			continue;
+		}
+		gint64 start = g_get_monotonic_time();
+		gchar* preamble = nk_latex_preamble_new(self->settings, item->input);
+		gchar* doc = nk_latex_document_new(preamble, item->input, &item->input_line);
+
+		// formats built in the meantime are picked up by later items
+		item->engine = nk_engine_choose(self->settings, item->input);
+		gchar* fmt = nk_fmt_cache_lookup(nk_fmt_cache_get_default(), item->engine, preamble);
+		g_free(preamble);
+		item->document_time = g_get_monotonic_time() - start;
+		NkTexWorker* worker = nk_tex_worker_spawn_for(item->engine, fmt, doc, &err);
+		NkTexJobFlags flags = g_settings_get_boolean(self->settings, "optimize-svg") ? NK_TEX_JOB_OPTIMIZE : NK_TEX_JOB_NONE;
+		if (self->benchmark && (flags & NK_TEX_JOB_OPTIMIZE)) {
+			item->doc = g_steal_pointer(&doc);
+			item->fmt = g_steal_pointer(&fmt);
+		}
+		g_free(fmt);
+		g_free(doc);
+		if (!worker) {
+			g_warning("Failed launching %s: %s\n", nk_engines[item->engine].program, err->message);
+			g_error_free(err);
+			nk_batch_item_finish(item, FALSE);
+			continue;
+		}
+		nk_tex_worker_run_async(worker, NULL, flags, NULL, (GAsyncReadyCallback)nk_batch_result_cb, item);
+	}
+
+	if (self->running == 0 && g_queue_is_empty(&self->pending))
+		g_main_loop_quit(self->loop);
+}
+
+/* Renders everything queued, returns the number of sources that failed. */
+guint nk_batch_run(NkBatch* self, GError** err) {
+	gboolean widgets = FALSE;
+	for (GList* l = self->pending.head; l; l = l->next)
+		widgets |= ((NkBatchItem*)l->data)->widget != NULL;
+	if (widgets && !(self->con = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, err)))
+		return self->pending.length;
+
+	self->total = self->pending.length;
+	self->loop = g_main_loop_new(NULL, FALSE);
+
+	NkFmtCache* fmt_cache = nk_fmt_cache_get_default();
+	if (self->benchmark) {
+		// only time warm compiles, so build the formats of every input first
+		for (GList* l = self->pending.head; l; l = l->next) {
+			NkBatchItem* item = l->data;
+			if (!nk_batch_item_load(item))
+				continue;
+			gchar* preamble = nk_latex_preamble_new(self->settings, item->input);
+			g_free(nk_fmt_cache_lookup(fmt_cache, nk_engine_choose(self->settings, item->input), preamble));
+			g_free(preamble);
+		}
+		// builds are killed after render-timeout, give them a moment more to clean up
+		guint wait = nk_tex_limits.timeout ? nk_tex_limits.timeout + 5 : NK_FMT_CACHE_WAIT;
+		if (!nk_fmt_cache_wait(fmt_cache, wait))
+			g_warning("formats not ready after %us, their inputs compile cold\n", wait);
+	}
+
+	nk_batch_next(self);
+	if (self->running)
+		g_main_loop_run(self->loop);
+
+	// builds started by this run would outlive it half-written
+	nk_fmt_cache_abort(fmt_cache);
+
+	g_main_loop_unref(self->loop);
+
+	if (self->con)
+		g_dbus_connection_flush_sync(self->con, NULL, NULL);
+
+	return self->failed;
+}
+
+/* Render scheduler.
+ *
+ * Renders of all windows are queued on the scheduler of the NkExtAppl. At
+ * most max of them compile at once (the number of cores if 0), the focused
+ * window goes first and only the newest request of every window is kept.
+ */
+struct NkRenderScheduler {
+	GQueue queue;
+	guint running;
+	guint max;
+};
+
+typedef struct NkRenderRequest {
+	NkRenderScheduler* scheduler;
+	gpointer owner;
+	GtkWindow* window;
+	gchar* doc;
+	NkEngine engine;
+	gchar* fmt;
+	guint workers;
+	NkTexJobFlags flags;
+	GCancellable* cancellable;
+	gboolean started;
+	GAsyncReadyCallback cb;
+	gpointer user_data;
+} NkRenderRequest;
+static void nk_render_request_free(NkRenderRequest* req) {
+	g_object_unref(req->window);
+	g_free(req->doc);
+	g_free(req->fmt);
+	g_object_unref(req->cancellable);
+	g_free(req);
+}
+
+NkRenderScheduler* nk_render_scheduler_new(void) {
+	NkRenderScheduler* self = g_new0(NkRenderScheduler, 1);
+	g_queue_init(&self->queue);
+	return self;
+}
+
+void nk_render_scheduler_free(NkRenderScheduler* self) {
+	// only at exit, the windows the callbacks would update are gone
+	g_queue_free_full(&self->queue, (GDestroyNotify)nk_render_request_free);
+	g_free(self);
+}
+
+static void nk_render_scheduler_pump(NkRenderScheduler* self);
+
+static void nk_render_request_cb(GObject* src, GAsyncResult* res, NkRenderRequest* req) {
+	NkRenderScheduler* self = req->scheduler;
+	gboolean started = req->started;
+
+	req->cb(src, res, req->user_data);
+	nk_render_request_free(req);
+
+	if (started) {
+		self->running--;
+		nk_render_scheduler_pump(self);
+	}
+}
+
+// hands err to the request's callback as result
+static void nk_render_request_fail(NkRenderRequest* req, GError* err) {
+	GTask* task = g_task_new(NULL, req->cancellable, (GAsyncReadyCallback)nk_render_request_cb, req);
+	g_task_return_error(task, err);
+	g_object_unref(task);
+}
+
+static void nk_render_request_start(NkRenderRequest* req) {
+	GError* err = NULL;
+	if (g_cancellable_set_error_if_cancelled(req->cancellable, &err)) {
+		nk_render_request_fail(req, err);
+		return;
+	}
+
+	const gchar* doc = req->doc;
+	NkTexWorker* worker = NULL;
+	if (req->fmt)
+		worker = nk_tex_worker_pool_acquire(nk_tex_worker_pool_get_default(), req->engine, req->fmt, req->workers);
+	if (!worker) {
+		worker = nk_tex_worker_spawn_for(req->engine, req->fmt, req->doc, &err);
+		doc = NULL;
+	}
+	if (!worker) {
+		nk_render_request_fail(req, err);
+		return;
+	}
+
+	req->started = TRUE;
+	req->scheduler->running++;
+	nk_tex_worker_run_async(worker, doc, req->flags, req->cancellable, (GAsyncReadyCallback)nk_render_request_cb, req);
+}
+
+static void nk_render_scheduler_pump(NkRenderScheduler* self) {
+	guint max = self->max ? self->max : g_get_num_processors();
+
+	while (self->running < max && !g_queue_is_empty(&self->queue)) {
+		// cancelled requests only need their callback, they go first
+		GList* pick = NULL;
+		for (GList* l = self->queue.head; l && !pick; l = l->next) {
+			NkRenderRequest* req = l->data;
+			if (g_cancellable_is_cancelled(req->cancellable))
+				pick = l;
+		}
+		for (GList* l = self->queue.head; l && !pick; l = l->next) {
+			NkRenderRequest* req = l->data;
+			if (gtk_window_is_active(req->window))
+				pick = l;
+		}
+		if (!pick)
+			pick = self->queue.head;
+
+		NkRenderRequest* req = pick->data;
+		g_queue_delete_link(&self->queue, pick);
+		nk_render_request_start(req);
+	}
+}
+
+void nk_render_scheduler_set_max(NkRenderScheduler* self, guint max) {
+	self->max = max;
+	nk_tex_limits.renders = max;
+	nk_render_scheduler_pump(self);
+}
+
+/* Queues compiling doc with engine for owner, a window's render state, with
+ * a format if fmt isn't NULL. Takes doc and fmt. A request of owner that didn't start
+ * yet is cancelled. cb gets a result for nk_tex_worker_run_finish(). */
+void nk_render_scheduler_submit(NkRenderScheduler* self, gpointer owner, GtkWindow* window, gchar* doc, NkEngine engine, gchar* fmt, guint workers, NkTexJobFlags flags, GCancellable* cancellable, GAsyncReadyCallback cb, gpointer user_data) {
+	for (GList* l = self->queue.head; l;) {
+		GList* next = l->next;
+		NkRenderRequest* old = l->data;
+		if (old->owner == owner) {
+			g_queue_delete_link(&self->queue, l);
+			g_cancellable_cancel(old->cancellable);
+			nk_render_request_start(old);
+		}
+		l = next;
+	}
+
+	NkRenderRequest* req = g_new0(NkRenderRequest, 1);
+	req->scheduler = self;
+	req->owner = owner;
+	req->window = g_object_ref(window);
+	req->doc = doc;
+	req->engine = engine;
+	req->fmt = fmt;
+	req->workers = workers;
+	req->flags = flags;
+	req->cancellable = g_object_ref(cancellable);
+	req->cb = cb;
+	req->user_data = user_data;
+	g_queue_push_tail(&self->queue, req);
+
+	nk_render_scheduler_pump(self);
+}
+
+enum {
+	PANE_EDIT,
+	PANE_RENDER
+};
+
+typedef struct LatexResultDataCb {
+	gchar* key;
+	GCancellable* cancellable;
+	GtkButton* btn;
+	RsvgHandle** svg;
+	GBytes** svg_data;
+	GtkWidget* res_stack;
+	NkLatexSvgArea* render;
+	GtkLabel* error;
+	GtkSourceBuffer* buf;
+	guint8* pane_state;
+	gint input_line;
+	gint64 started;
+} LatexResultDataCb;
+
+#define NK_ERROR_MARK_CATEGORY "tex-error"
+
+static void latex_clear_errors(GtkSourceBuffer* buf) {
+	GtkTextIter start,end;
+	gtk_text_buffer_get_bounds(GTK_TEXT_BUFFER(buf), &start, &end);
+	gtk_source_buffer_remove_source_marks(buf, &start, &end, NK_ERROR_MARK_CATEGORY);
+}
+
+/* Marks the lines errors refer to in the editor and returns a summary of all
+ * errors, or NULL if none could be picked out of the log. */
+static gchar* latex_mark_errors(LatexResultDataCb* user_data, GPtrArray* errors) {
+	if (!errors || errors->len == 0)
+		return NULL;
+
+	GString* summary = g_string_new(NULL);
+	gint lines = gtk_text_buffer_get_line_count(GTK_TEXT_BUFFER(user_data->buf));
+	for (guint i = 0; i < errors->len; i++) {
+		NkTexError* error = g_ptr_array_index(errors, i);
+		gint line = error->line >= 0 ? error->line - user_data->input_line : -1;
+
+		if (line >= 0 && line < lines) {
+			GtkTextIter iter;
+			gtk_text_buffer_get_iter_at_line(GTK_TEXT_BUFFER(user_data->buf), &iter, line);
+			GtkSourceMark* mark = gtk_source_buffer_create_source_mark(user_data->buf, NULL, NK_ERROR_MARK_CATEGORY, &iter);
+			g_object_set_data_full(G_OBJECT(mark), "message", g_strdup(error->message), g_free);
+			g_string_append_printf(summary, "Line %d: %s\n", line + 1, error->message);
+		} else {
+			// somewhere in the preamble or the template
+			g_string_append_printf(summary, "%s\n", error->message);
+		}
+		if (error->context && *error->context)
+			g_string_append_printf(summary, "\t%s\n", error->context);
+	}
+	return g_string_free(summary, FALSE);
+}
+
+static gchar* latex_error_tooltip(GtkSourceMarkAttributes*, GtkSourceMark* mark, gpointer) {
+	return g_strdup(g_object_get_data(G_OBJECT(mark), "message"));
+}
+
+static void latex_show_result(LatexResultDataCb* user_data, RsvgHandle* handle, GBytes* svg) {
+	g_object_unref(*user_data->svg);
+	*user_data->svg = handle;
+	// kept for the export path
+	if (*user_data->svg_data)
+		g_bytes_unref(*user_data->svg_data);
+	*user_data->svg_data = svg;
+	//RsvgRectangle rect;
+	//rsvg_handle_get_intrinsic_dimensions(handle, NULL, NULL, NULL, NULL, NULL, &rect);
+	//gtk_drawing_area_set_content_width(user_data->render, 2*(rect.width+rect.x));
+	//gtk_drawing_area_set_content_height(user_data->render, rect.height + rect.y);
+	gtk_widget_set_visible(GTK_WIDGET(user_data->render), TRUE);
+	nk_latex_svg_area_update(user_data->render);
+	// a live preview result is as good to export as a clicked one
+	gtk_button_set_label(user_data->btn, "Export");
+	*user_data->pane_state = PANE_RENDER;
+}
+
+static void latex_result_data_free(LatexResultDataCb* user_data) {
+	g_object_unref(user_data->cancellable);
+	g_free(user_data->key);
+	g_free(user_data);
+}
+
+/* Completes a render job, however it was compiled. On success svg holds the
+ * document and bsl its baseline metrics, otherwise log holds the compiler
+ * output. Takes ownership of user_data. */
+static gchar* latex_limit_message(NkTexLimit limit) {
+	if (limit == NK_TEX_LIMIT_TIME)
+		return g_strdup("Rendering timed out and was stopped. Check for endless loops or raise the time limit in the preferences.");
+	return g_strdup("Rendering ran out of memory and was stopped. Raise the memory limit in the preferences if the formula really needs more.");
+}
+
+static void latex_render_done(LatexResultDataCb* user_data, gboolean success, NkTexLimit limit, GBytes* svg, GBytes* bsl, GBytes* log, GPtrArray* errors) {
+	// superseded by a newer job (or the window is gone), don't touch *svg
+	if (g_cancellable_is_cancelled(user_data->cancellable)) {
+		latex_result_data_free(user_data);
+		return;
+	}
+
+	gtk_widget_set_sensitive(GTK_WIDGET(user_data->btn), TRUE);
+	gtk_widget_set_visible(GTK_WIDGET(user_data->res_stack), TRUE);
+
+	latex_clear_errors(user_data->buf);
+	nk_stats_span(NK_PHASE_RENDER, user_data->started, g_get_monotonic_time(),
+		success ? NULL : limit == NK_TEX_LIMIT_TIME ? "timed out" : limit == NK_TEX_LIMIT_MEMORY ? "out of memory" : "failed");
+	if (!success) {
+		// whatever TeX said before it got killed is beside the point
+		gchar* text = limit ? latex_limit_message(limit) : latex_mark_errors(user_data, errors);
+		if (!text) {
+			// nothing TeX-like in there, show the tail of the raw output
+			gsize len = 0;
+			const gchar* data = log ? g_bytes_get_data(log, &len) : NULL;
+			text = g_strndup(data ? data : "", len);
+		}
+
+		gtk_label_set_text(user_data->error, text);
+		gtk_widget_set_visible(GTK_WIDGET(user_data->render), FALSE);
+		g_free(text);
+	} else {
+		RsvgHandle* handle;
+		GError* perr = NULL;
+		gint64 begin = g_get_monotonic_time();
+		handle = nk_svg_handle_new(svg, &perr);
+		nk_stats_span(NK_PHASE_PARSE, begin, g_get_monotonic_time(), NULL);
+		if (perr) {
+			g_warning("unable to parse svg: %s\n", perr->message);
+			g_error_free(perr);
+		} else {
+			nk_render_cache_insert(nk_render_cache_get_default(), user_data->key, handle, svg, bsl);
+			latex_show_result(user_data, handle, g_bytes_ref(svg));
+		}
+	}
+
+	latex_result_data_free(user_data);
+}
+
+static void latex_result_cb(GObject*, GAsyncResult* res, LatexResultDataCb* user_data) {
+	NkTexJobResult* result;
+	GError* err = NULL;
+	result = nk_tex_worker_run_finish(res, &err);
+	if (!result && g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		latex_result_data_free(user_data);
+		g_error_free(err);
+		return;
+	}
+	if (!result) {
+		g_critical("failed running tex worker: %s\n", err->message);
+		GBytes* log = g_bytes_new(err->message, strlen(err->message));
+		latex_render_done(user_data, FALSE, NK_TEX_LIMIT_NONE, NULL, NULL, log, NULL);
+		g_bytes_unref(log);
+		g_error_free(err);
+		return;
+	}
+
+	latex_render_done(user_data, result->success, result->limit, result->svg, result->bsl, result->log, result->errors);
+	nk_tex_job_result_free(result);
+}
+
+typedef struct LatexBlocksData {
+	// NULL once the render completed (failed) early
+	LatexResultDataCb* result;
+	// the blocks' jobs, cancelled along with the render or once a block failed
+	GCancellable* cancellable;
+	GCancellable* render_cancellable;
+	gulong render_cancelled;
+	guint n_blocks;
+	guint pending;
+	gchar** keys;
+	GBytes** svgs;
+	GBytes** bsls;
+	GArray* lines;
+} LatexBlocksData;
+
+typedef struct LatexBlockData {
+	LatexBlocksData* blocks;
+	guint index;
+} LatexBlockData;
+
+static void latex_blocks_finish(LatexBlocksData* blocks) {
+	if (blocks->result && g_cancellable_is_cancelled(blocks->result->cancellable)) {
+		latex_result_data_free(blocks->result);
+	} else if (blocks->result) {
+		GBytes* bsl;
+		GBytes* svg = nk_svg_stack(blocks->svgs, blocks->bsls, blocks->n_blocks, &bsl);
+		latex_render_done(blocks->result, TRUE, NK_TEX_LIMIT_NONE, svg, bsl, NULL, NULL);
+		g_bytes_unref(svg);
+		g_bytes_unref(bsl);
+	}
+
+	for (guint i = 0; i < blocks->n_blocks; i++) {
+		if (blocks->svgs[i])
+			g_bytes_unref(blocks->svgs[i]);
+		if (blocks->bsls[i])
+			g_bytes_unref(blocks->bsls[i]);
+	}
+	g_cancellable_disconnect(blocks->render_cancellable, blocks->render_cancelled);
+	g_object_unref(blocks->render_cancellable);
+	g_object_unref(blocks->cancellable);
+	g_strfreev(blocks->keys);
+	g_free(blocks->svgs);
+	g_free(blocks->bsls);
+	g_array_unref(blocks->lines);
+	g_free(blocks);
+}
+
+static void latex_block_cb(GObject*, GAsyncResult* res, LatexBlockData* block_d) {
+	LatexBlocksData* blocks = block_d->blocks;
+	guint index = block_d->index;
+	g_free(block_d);
+
+	GError* err = NULL;
+	NkTexJobResult* result = nk_tex_worker_run_finish(res, &err);
+	if (!result) {
+		if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED) && blocks->result) {
+			g_critical("failed running tex worker: %s\n", err->message);
+			GBytes* log = g_bytes_new(err->message, strlen(err->message));
+			latex_render_done(g_steal_pointer(&blocks->result), FALSE, NK_TEX_LIMIT_NONE, NULL, NULL, log, NULL);
+			g_bytes_unref(log);
+			g_cancellable_cancel(blocks->cancellable);
+		}
+		g_error_free(err);
+	} else if (!result->success) {
+		// the first failing block is reported, its errors mapped to its lines
+		if (blocks->result) {
+			blocks->result->input_line -= g_array_index(blocks->lines, gint, index);
+			latex_render_done(g_steal_pointer(&blocks->result), FALSE, result->limit, NULL, NULL, result->log, result->errors);
+			// the stack can't be completed anymore
+			g_cancellable_cancel(blocks->cancellable);
+		}
+	} else {
+		// cached even if the render as a whole fails, the block is fine
+		RsvgHandle* handle = nk_svg_handle_new(result->svg, NULL);
+		if (handle) {
+			nk_render_cache_insert(nk_render_cache_get_default(), blocks->keys[index], handle, result->svg, result->bsl);
+			g_object_unref(handle);
+		}
+		blocks->svgs[index] = g_bytes_ref(result->svg);
+		blocks->bsls[index] = result->bsl ? g_bytes_ref(result->bsl) : NULL;
+	}
+	if (result)
+		nk_tex_job_result_free(result);
+
+	if (--blocks->pending == 0)
+		latex_blocks_finish(blocks);
+}
+
+static void latex_blocks_cancel(GCancellable*, GCancellable* cancellable) {
+	g_cancellable_cancel(cancellable);
+}
+
+/* Renders input block by block, see nk_latex_blocks_split(). Blocks found in
+ * the render cache are reused, the others are submitted to the scheduler
+ * separately so they compile in parallel. Takes ownership of user_data. */
+static void latex_render_blocks(LatexResultDataCb* user_data, GtkWindow* window, GPtrArray* input_blocks, GArray* lines, const gchar* preamble, NkEngine engine, const gchar* fmt, guint workers, NkTexJobFlags flags) {
+	NkRenderScheduler* scheduler = nk_ext_appl_get_scheduler(NOTEKIT_APPLICATION(gtk_window_get_application(window)));
+	LatexBlocksData* blocks = g_new0(LatexBlocksData, 1);
+	blocks->result = user_data;
+	blocks->n_blocks = input_blocks->len;
+	blocks->keys = g_new0(gchar*, input_blocks->len + 1);
+	blocks->svgs = g_new0(GBytes*, input_blocks->len);
+	blocks->bsls = g_new0(GBytes*, input_blocks->len);
+	blocks->lines = g_array_ref(lines);
+	blocks->cancellable = g_cancellable_new();
+	blocks->render_cancellable = g_object_ref(user_data->cancellable);
+	blocks->render_cancelled = g_cancellable_connect(user_data->cancellable, G_CALLBACK(latex_blocks_cancel), g_object_ref(blocks->cancellable), g_object_unref);
+	// held until every block is submitted, so none can finish the render early
+	blocks->pending = 1;
+
+	guint cached = 0;
+	for (guint i = 0; i < input_blocks->len; i++) {
+		gchar* doc = nk_latex_document_new(preamble, g_ptr_array_index(input_blocks, i), NULL);
+		blocks->keys[i] = nk_render_cache_key(doc, engine, flags);
+
+		RsvgHandle* handle = nk_render_cache_lookup(nk_render_cache_get_default(), blocks->keys[i], &blocks->svgs[i], &blocks->bsls[i]);
+		if (handle) {
+			g_object_unref(handle);
+			g_free(doc);
+			cached++;
+			continue;
+		}
+
+		LatexBlockData* block_d = g_new(LatexBlockData, 1);
+		block_d->blocks = blocks;
+		block_d->index = i;
+		blocks->pending++;
+		// every block is its own owner, they must not supersede each other
+		nk_render_scheduler_submit(scheduler, block_d, window, doc, engine, g_strdup(fmt), workers, flags,
+			blocks->cancellable, (GAsyncReadyCallback)latex_block_cb, block_d);
+	}
+	g_debug("rendering %u blocks, %u cached\n", blocks->n_blocks, cached);
+
+	if (--blocks->pending == 0)
+		latex_blocks_finish(blocks);
+}
+
+static void updated_image_path(GObject* src, GAsyncResult* res, gpointer) {
+	GError* err = NULL;
+	GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(src), res, &err);
+	if (!ret) {
+		g_warning("Error %d failed updating edata path of image: %s\n", err->code, err->message);
+		g_error_free(err);
+		return;
+	}
+	g_variant_unref(ret);
+}
+
+typedef struct NkActivateArgs {
+	GVariant* file;
+	GVariant* widget;
+} NkActivateArgs;
+
+typedef struct InsertNkeCbData {
+	gchar* data;
+	// only written back while closing isn't cancelled, the window owns it
+	NkActivateArgs* args;
+	GCancellable* closing;
+	GVariant* widget;
+	gint64 started;
+	GDBusConnection* con;
+	gchar* filepath;
+	RsvgHandle* handle;
+	GSettings* settings;
+} InsertNkeCbData;
+static void insert_nke_saved(GObject*, GAsyncResult* res, InsertNkeCbData* user_data) {
+	GError* err = NULL;
+	if (!nk_sidecar_save_finish(res, &err)) {
+		g_critical("failed saving document: %s\n", err->message);
+		g_error_free(err);
+	}
+
+	// only point NoteKit at the sidecar once it is there
+	g_dbus_connection_call(user_data->con,
+		"com.github.blackhole89.notekit",
+		"/com/github/blackhole89/NoteKit/Notebook/1",
+		"com.github.blackhole89.NoteKit.Notebook",
+		"update_nke_edata",
+		g_variant_new("(@(ss)s)",
+			user_data->widget,
+			user_data->filepath
+		),
+		NULL,
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		NULL,
+		(GAsyncReadyCallback) updated_image_path,
+		NULL
+	);
+
+	g_debug("inserted image to notekit\n");
+	g_free(user_data->filepath);
+	g_variant_unref(user_data->widget);
+	g_object_unref(user_data->handle);
+	g_object_unref(user_data->closing);
+	g_free(user_data);
 }
 
-typedef struct NkActivateArgs {
-	GVariant* file;
-	GVariant* widget;
-} NkActivateArgs;
-
-typedef struct InsertNkeCbData {
-	gchar* data;
-	NkActivateArgs* args;
-} InsertNkeCbData;
 static void insert_nke_cb(GObject* src, GAsyncResult* res, InsertNkeCbData* user_data) {
 	GError* err = NULL;
 	GVariant* ret;
 	ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(src), res, &err);
+	nk_stats_span(NK_PHASE_EXPORT, user_data->started, g_get_monotonic_time(), err ? "insert_nke failed" : "insert_nke");
 	if (err) {
 		g_warning("Error %d failed sending image to NoteKit: %s\n", err->code, err->message);
 		g_error_free(err);
+		g_free(user_data->data);
+		g_object_unref(user_data->handle);
+		g_object_unref(user_data->closing);
+		g_free(user_data);
 		return;
 	}
-	g_variant_get(ret, "(@(ss))", &user_data->args->widget);
+	g_variant_get(ret, "(@(ss))", &user_data->widget);
+	g_variant_unref(ret);
 
 	const gchar* active_note;
 	gchar* a_note_dir;
 	gchar* a_note_name;
 	const gchar* uuid;
 	gchar* filepath;
-	GFile* file;
-	GFile* dir;
 
-	g_variant_get(user_data->args->widget, "(ss)", &active_note, &uuid);
+	g_variant_get(user_data->widget, "(&s&s)", &active_note, &uuid);
 	a_note_dir = g_path_get_dirname(active_note);
 	a_note_name = g_path_get_basename(active_note);
-	//g_free(active_note);	
 	
-	gchar* sfx = g_strrstr(a_note_name, ".md");
-	sfx[0] = 0x0;
-	sfx[1] = 0x0;
-	sfx[2] = 0x0;
+	if (g_str_has_suffix(a_note_name, ".md"))
+		a_note_name[strlen(a_note_name) - strlen(".md")] = 0x0;
 
 	filepath = g_strdup_printf("%s/.%s/%s~%s.tex", a_note_dir, APPL_ID, a_note_name, uuid);
 	g_free(a_note_dir);
 	g_free(a_note_name);
 
 
-	file = g_file_new_for_path(filepath);
-	dir = g_file_get_parent(file);
-	g_file_make_directory(dir, NULL, NULL);
-	g_object_unref(dir);
-	GError* rerr = NULL;
-	g_file_replace_contents(file, user_data->data, strlen(user_data->data), NULL, false, G_FILE_CREATE_NONE, NULL, NULL, &rerr);
-	if (rerr) {
-		g_critical("failed saving document: %s\n", rerr->message);
-		g_error_free(rerr);
+	// NoteKit has the image now, its sidecar is saved even if the window is gone
+	if (!g_cancellable_is_cancelled(user_data->closing)) {
+		user_data->args->widget = g_variant_ref(user_data->widget);
+		user_data->args->file = g_variant_ref_sink(g_variant_new("s", filepath));
 	}
-	user_data->args->file = g_variant_new("s", filepath);
-
-	g_dbus_connection_call(G_DBUS_CONNECTION(src),
-		"com.github.blackhole89.notekit",
-		"/com/github/blackhole89/NoteKit/Notebook/1",
-		"com.github.blackhole89.NoteKit.Notebook",
-		"update_nke_edata",
-		g_variant_new("(@(ss)s)",
-			g_variant_ref(user_data->args->widget),
-			filepath
-		),
-		NULL,
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,
-		NULL,
-		(GAsyncReadyCallback) updated_image_path,
-		NULL
-	);
 
-	g_print("inserted image to notekit\n");
-	g_free(user_data->data);
-	g_free(user_data);
+	user_data->con = G_DBUS_CONNECTION(src);
+	user_data->filepath = filepath;
+	nk_renditions_export(user_data->settings, user_data->handle, filepath);
+	nk_sidecar_save_async(filepath, user_data->data, NULL, (GAsyncReadyCallback)insert_nke_saved, user_data);
+	user_data->data = NULL;
 }
 
-static void sent_msg_cb(GObject* src, GAsyncResult* res, gpointer) {
-	GError* err;
-	if (!g_dbus_connection_call_finish(G_DBUS_CONNECTION(src), res, &err)) {
+static void sent_msg_cb(GObject* src, GAsyncResult* res, gint64* started) {
+	GError* err = NULL;
+	GVariant* ret = g_dbus_connection_call_finish(G_DBUS_CONNECTION(src), res, &err);
+	nk_stats_span(NK_PHASE_EXPORT, *started, g_get_monotonic_time(), ret ? "update_nke" : "update_nke failed");
+	g_free(started);
+	if (!ret) {
 		g_warning("Error %d failed sending image to NoteKit: %s\n", err->code, err->message);
 		g_error_free(err);
 		return;
 	}
-	g_print("sent image to notekit\n");
+	g_variant_unref(ret);
+	g_debug("sent image to notekit\n");
+}
+
+static void sidecar_saved_cb(GObject*, GAsyncResult* res, gpointer) {
+	GError* err = NULL;
+	if (!nk_sidecar_save_finish(res, &err)) {
+		g_critical("failed saving document: %s\n", err->message);
+		g_error_free(err);
+	}
 }
 
 typedef struct PBtnClickedData {
@@ -422,257 +4223,288 @@ typedef struct PBtnClickedData {
 	GtkSourceBuffer* buf;
 	AdwLeaflet* leaflet;
 	GtkWidget* res;
-	int* svg_fd;
 	RsvgHandle** svg;
+	GBytes** svg_data;
 	GtkWidget* res_stack;
 	NkLatexSvgArea* render;
 	GtkLabel* error;
 	guint8* pane_state;
 	GDBusConnection* con;
 	NkActivateArgs* args;
+	GtkButton* btn;
+	GCancellable* cancellable;
+	// cancelled when the window is destroyed, for exports outliving it
+	GCancellable* closing;
+	guint live_source;
 } PBtnClickedData;
-static void pbtn_clicked(GtkButton* btn, PBtnClickedData* user_data) {
-	if (*user_data->pane_state == PANE_EDIT) {
-		GtkTextIter start,end;
-		GString* packages;
-		const gchar* custom_preamble;
-		const char* input;
-		const char* doc;
 
-		gtk_widget_set_visible(user_data->res, TRUE);
+
+static void latex_render(PBtnClickedData* user_data, gboolean interactive) {
+	GtkButton* btn = user_data->btn;
+	GtkTextIter start,end;
+	gchar* preamble;
+	gchar* fmt;
+	gchar* input;
+	gchar* doc;
+	gint input_line;
+	gint64 started = g_get_monotonic_time();
+
+	nk_stats_count(NK_COUNTER_RENDERS);
+	gtk_widget_set_visible(user_data->res, TRUE);
+	if (interactive) {
 		gtk_widget_set_visible(GTK_WIDGET(user_data->res_stack), FALSE);
 		gtk_button_set_label(btn, "Export");
 		gtk_widget_set_sensitive(GTK_WIDGET(btn), FALSE);
 		adw_leaflet_navigate(user_data->leaflet, ADW_NAVIGATION_DIRECTION_FORWARD);
 		*user_data->pane_state = PANE_RENDER;
-		
-		gtk_text_buffer_get_start_iter(GTK_TEXT_BUFFER(user_data->buf), &start);
-		gtk_text_buffer_get_end_iter(GTK_TEXT_BUFFER(user_data->buf), &end);
-		input = gtk_text_buffer_get_text(GTK_TEXT_BUFFER(user_data->buf), &start, &end, FALSE);
-		printf("goin to render: %s\n", input);
-
-		packages = g_string_new("");
-		if (g_settings_get_boolean(user_data->settings, "pkg-tikz"))
-			g_string_append(packages, "\\usepackage{tikz}\n");
-		if (g_settings_get_boolean(user_data->settings, "pkg-circuitikz"))
-			g_string_append(packages, "\\usepackage{circuitikz}\n");
-		if (g_settings_get_boolean(user_data->settings, "pkg-chemfig"))
-			g_string_append(packages, "\\usepackage{chemfig}\n");
-		if (g_settings_get_boolean(user_data->settings, "pkg-mhchem"))
-			g_string_append(packages, "\\usepackage{mhchem}\n");
-
-		custom_preamble = g_settings_get_string(user_data->settings, "custom-preamble");
-		
-		doc = g_strdup_printf(	"\\documentclass[10pt,dvisvgm]{article}\n"
-					"\\usepackage{amsmath}\n"
-					"\\usepackage{amssymb}\n"
-					"\\usepackage[usenames]{color}\n"
-					"\\usepackage{ifxetex}\n"
-					"\n"
-					"%% XeLaTeX compiler\n"
-					"\\ifxetex\n"
-					"\n"
-					"    \\usepackage{fontspec}\n"
-					"    \\usepackage{unicode-math}\n"
-					"\n"
-					"    %% Uncomment these lines for alternative fonts\n"
-					"    %%\\setmainfont{FreeSerif}\n"
-					"    %%\\setmathfont{FreeSerif}\n"
-					"\n"
-					"%% LaTeX compiler\n"
-					"\\else\n"
-					"\n"
-					"    %% Uncomment this line for sans-serif maths font\n"
-					"    %%\\everymath{\\mathsf{\\xdef\\mysf{\\mathgroup\\the\\mathgroup\\relax}}\\mysf}\n"
-					"\n"
-					"\\fi\n"
-					"\n"
-					"%s"
-					"%s"
-					"\n"
-					"\\pagestyle{empty}\n"
-					"\n"
-					"\\begin{document}\n"
-					"\\newsavebox{\\eqbox}\n"
-					"\\newlength{\\width}\n"
-					"\\newlength{\\height}\n"
-					"\\newlength{\\depth}\n"
-					"\\begin{lrbox}{\\eqbox}\n"
-					"{$\\displaystyle\n"
-					"	%s\n"
-					"$}\n"
-					"\\end{lrbox}\n"
-					"\\settowidth {\\width}  {\\usebox{\\eqbox}}\n"
-					"\\settoheight{\\height} {\\usebox{\\eqbox}}\n"
-					"\\settodepth {\\depth}  {\\usebox{\\eqbox}}\n"
-					"\\newwrite\\file\n"
-					"\\immediate\\openout\\file=\\jobname.bsl\n"
-					"\\immediate\\write\\file{Depth = \\the\\depth}\n"
-					"\\immediate\\write\\file{Height = \\the\\height}\n"
-					"\\addtolength{\\height} {\\depth}\n"
-					"\\immediate\\write\\file{TotalHeight = \\the\\height}\n"
-					"\\immediate\\write\\file{Width = \\the\\width}\n"
-					"\\closeout\\file\n"
-					"\\usebox{\\eqbox}\n"
-					"\\end{document}\n"
-					"\n", packages->str, custom_preamble, input);
-
-		g_string_free(packages, TRUE);
-		
-		int fd = memfd_create("latex_doc.tex", 0);
-		if (fd == -1) {
-			char* err = strerror(errno);
-			g_critical("failed creating memfd: %s\n", err);
-			free(err);
-			return;
-		}
-		ssize_t res = write(fd, doc, strlen(doc));
-		if (res == -1) {
-			char* err = strerror(errno);
-			g_critical("failed writing to memfd: %s\n", err);
-			free(err);
-			return;
-		}
-		const gchar* doc_path = g_strdup_printf("/proc/%d/fd/%d\n", getpid(), fd);
+	}
 
-		if (*user_data->svg_fd != 0)
-			close(*user_data->svg_fd);
-		*user_data->svg_fd = memfd_create("result.svg", 0);
-		if (*user_data->svg_fd == -1) {
-			char* err = strerror(errno);
-			g_critical("failed creating memfd: %s\n", err);
-			free(err);
-			return;
+	// only the newest job of a window may run, results of older ones are dropped
+	if (user_data->cancellable) {
+		g_cancellable_cancel(user_data->cancellable);
+		g_object_unref(user_data->cancellable);
+	}
+	user_data->cancellable = g_cancellable_new();
+	
+	gtk_text_buffer_get_start_iter(GTK_TEXT_BUFFER(user_data->buf), &start);
+	gtk_text_buffer_get_end_iter(GTK_TEXT_BUFFER(user_data->buf), &end);
+	input = gtk_text_buffer_get_text(GTK_TEXT_BUFFER(user_data->buf), &start, &end, FALSE);
+
+	preamble = nk_latex_preamble_new(user_data->settings, input);
+	doc = nk_latex_document_new(preamble, input, &input_line);
+
+	NkEngine engine = nk_engine_choose(user_data->settings, input);
+	NkTexJobFlags flags = g_settings_get_boolean(user_data->settings, "optimize-svg") ? NK_TEX_JOB_OPTIMIZE : NK_TEX_JOB_NONE;
+
+	GArray* lines = NULL;
+	GPtrArray* blocks = NULL;
+	if (g_settings_get_boolean(user_data->settings, "incremental-blocks") && nk_latex_blocks_independent(input)) {
+		lines = g_array_new(FALSE, FALSE, sizeof(gint));
+		blocks = nk_latex_blocks_split(input, lines);
+		gboolean split = blocks->len > 1;
+		for (guint i = 0; i < blocks->len && split; i++)
+			split = nk_latex_block_standalone(g_ptr_array_index(blocks, i));
+		if (!split) {
+			g_clear_pointer(&blocks, g_ptr_array_unref);
+			g_clear_pointer(&lines, g_array_unref);
 		}
-		const gchar* svg_path = g_strdup_printf("/proc/%d/fd/%d\n", getpid(), *user_data->svg_fd);
-
-		const gchar* env = g_getenv("NK_LATEX_LATEX2SVG_LOCATION");
-		GSubprocess* proc;		
-		GError* err = NULL;
-		if (env)
-			proc = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_PIPE, &err, env, doc_path, svg_path, NULL);
-		else
-			proc = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_PIPE, &err, LATEX2SVG_LOCATION, doc_path, svg_path, NULL);
-		if (err) {
-			g_warning("Failed launching latex2svg: %s\n", err->message);
-			g_error_free(err);
-
-			gtk_widget_set_sensitive(GTK_WIDGET(btn), TRUE);
-			gtk_widget_set_visible(GTK_WIDGET(user_data->res_stack), TRUE);
-			close(fd);
-
-			gtk_button_set_label(btn, "Render");
-			adw_leaflet_navigate(user_data->leaflet, ADW_NAVIGATION_DIRECTION_BACK);
-			*user_data->pane_state = PANE_EDIT;
+	}
+	g_free(input);
+
+	// a stack of blocks is laid out differently from the same input as a whole
+	gchar* key = nk_render_cache_key(doc, engine, blocks ? flags | NK_TEX_JOB_BLOCKS : flags);
+	nk_stats_span(NK_PHASE_DOCUMENT, started, g_get_monotonic_time(), NULL);
+	GBytes* cached_svg;
+	RsvgHandle* cached = nk_render_cache_lookup(nk_render_cache_get_default(), key, &cached_svg, NULL);
+	if (cached) {
+		LatexResultDataCb show_d = {
+			.cancellable = user_data->cancellable,
+			.btn = btn,
+			.svg = user_data->svg,
+			.svg_data = user_data->svg_data,
+			.res_stack = user_data->res_stack,
+			.render = user_data->render,
+			.error = user_data->error,
+			.pane_state = user_data->pane_state
+		};
+		gtk_widget_set_sensitive(GTK_WIDGET(btn), TRUE);
+		gtk_widget_set_visible(GTK_WIDGET(user_data->res_stack), TRUE);
+		latex_clear_errors(user_data->buf);
+		latex_show_result(&show_d, cached, cached_svg);
+		nk_stats_count(NK_COUNTER_CACHE_HITS);
+		nk_stats_span(NK_PHASE_RENDER, started, g_get_monotonic_time(), "cached");
+
+		g_free(key);
+		g_free(preamble);
+		g_free(doc);
+		if (blocks) {
+			g_ptr_array_unref(blocks);
+			g_array_unref(lines);
+		}
+		return;
+	}
+	fmt = nk_fmt_cache_lookup(nk_fmt_cache_get_default(), engine, preamble);
+
+	LatexResultDataCb* lres_d = g_new(LatexResultDataCb, 1);
+	lres_d->key = key;
+	lres_d->cancellable = g_object_ref(user_data->cancellable);
+	lres_d->btn = btn;
+	lres_d->svg = user_data->svg;
+	lres_d->svg_data = user_data->svg_data;
+	lres_d->res_stack = user_data->res_stack;
+	lres_d->render = user_data->render;
+	lres_d->error = user_data->error;
+	lres_d->buf = user_data->buf;
+	lres_d->pane_state = user_data->pane_state;
+	lres_d->input_line = input_line;
+	lres_d->started = started;
+
+	GtkWindow* window = GTK_WINDOW(gtk_widget_get_root(GTK_WIDGET(btn)));
+	guint workers = g_settings_get_int(user_data->settings, "tex-workers");
+	if (blocks) {
+		latex_render_blocks(lres_d, window, blocks, lines, preamble, engine, fmt, workers, flags);
+		g_ptr_array_unref(blocks);
+		g_array_unref(lines);
+		g_free(preamble);
+		g_free(doc);
+		g_free(fmt);
+		return;
+	}
+	g_free(preamble);
 
+	NkRenderScheduler* scheduler = nk_ext_appl_get_scheduler(NOTEKIT_APPLICATION(gtk_window_get_application(window)));
+	nk_render_scheduler_submit(scheduler, user_data, window, doc, engine, fmt,
+		workers, flags, user_data->cancellable, (GAsyncReadyCallback)latex_result_cb, lres_d);
+}
 
-			return;
-		}
-		LatexResultDataCb* lres_d = g_new(LatexResultDataCb, 1);
-		lres_d->doc_fd = fd;
-		lres_d->svg_fd = *user_data->svg_fd;
-		lres_d->btn = btn;
-		lres_d->svg = user_data->svg;
-		lres_d->res_stack = user_data->res_stack;
-		lres_d->render = user_data->render;
-		lres_d->error = user_data->error;
-		g_subprocess_wait_async(proc, NULL, (GAsyncReadyCallback)latex_result_cb, lres_d);
+typedef struct ExportData {
+	PBtnClickedData* pbtn;
+	gchar* tex;
+	gint64 started;
+	// what the payload is compressed with
+	gboolean zstd;
+	// the render being exported, live preview may replace pbtn's meanwhile
+	RsvgHandle* handle;
+	GCancellable* closing;
+} ExportData;
+static void export_payload_cb(GObject*, GAsyncResult* res, ExportData* data) {
+	PBtnClickedData* user_data = data->pbtn;
+	gchar* tex = data->tex;
+	gint64 started = data->started;
+	guint32 version = data->zstd ? NK_PAYLOAD_ZSTD : NK_PAYLOAD_ZLIB;
+	RsvgHandle* handle = data->handle;
+	GCancellable* closing = data->closing;
+	g_free(data);
+
+	// the window and user_data are gone
+	GError* perr = NULL;
+	GBytes* payload = nk_export_payload_new_finish(res, &perr);
+	g_object_unref(closing);
+	if (!payload && g_error_matches(perr, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free(perr);
+		g_object_unref(handle);
+		g_free(tex);
+		return;
+	}
+	gint64 now = g_get_monotonic_time();
+	nk_stats_span(NK_PHASE_COMPRESS, started, now, NULL);
+	if (!payload) {
+		g_critical("%s\n", perr->message);
+		g_error_free(perr);
+		g_object_unref(handle);
+		g_free(tex);
+		return;
+	}
+	GVariant* svg = g_variant_new_from_bytes(G_VARIANT_TYPE_BYTESTRING, payload, TRUE);
+	g_bytes_unref(payload);
+
+	if (user_data->args->widget != NULL) {
+		const gchar* sidecar = g_variant_get_string(user_data->args->file, NULL);
+		nk_renditions_export(user_data->settings, handle, sidecar);
+		g_object_unref(handle);
+		nk_sidecar_save_async(sidecar, tex, NULL, (GAsyncReadyCallback)sidecar_saved_cb, NULL);
+
+		gint64* sent = g_new(gint64, 1);
+		*sent = now;
+		g_dbus_connection_call(user_data->con,
+			"com.github.blackhole89.notekit",
+			"/com/github/blackhole89/NoteKit/Notebook/1",
+			"com.github.blackhole89.NoteKit.Notebook",
+			"update_nke",
+			g_variant_new("(@(ss)@(usay))",
+				user_data->args->widget,
+				g_variant_new("(us@ay)", version, "image/svg+xml", svg)
+			),
+			NULL,
+			G_DBUS_CALL_FLAGS_NONE,
+			-1,
+			NULL,
+			(GAsyncReadyCallback) sent_msg_cb,
+			sent
+		);
 	} else {
-		char* tex;
-
-		off_t size = lseek(*user_data->svg_fd, 0, SEEK_END);
-		lseek(*user_data->svg_fd, 0, SEEK_SET);
-		guint8* buffer = malloc(size);
-	
-		read(*user_data->svg_fd, buffer, size);
-
-		guint8* data;
-		/*size_t cbound = ZSTD_compressBound(size);
-		data = g_new(guint8, cbound);
-		size_t ret = ZSTD_compress(data, cbound, buffer, size, ZSTD_defaultCLevel());
-		if (ZSTD_isError(ret))
-			g_critical("failed compressing svg: %s\n", ZSTD_getErrorName(ret));*/
-		unsigned long ret;
-		unsigned long cbound = compressBound(size);
-		guint32 fsize = (guint32)size;
-		data = g_new(guint8, cbound+4);
-		memcpy(data, &fsize, 4);
-		int res = compress(&data[4], &ret, buffer, size);
-		if (res != Z_OK)
-			g_critical("faild compressing svg: Error %d\n", res);
+		InsertNkeCbData* cb_data = g_new(InsertNkeCbData, 1);
+		cb_data->args = user_data->args;
+		cb_data->data = tex;
+		cb_data->started = now;
+		cb_data->handle = handle;
+		cb_data->settings = user_data->settings;
+		cb_data->closing = g_object_ref(user_data->closing);
+
+		g_dbus_connection_call(user_data->con,
+			"com.github.blackhole89.notekit",
+			"/com/github/blackhole89/NoteKit/Notebook/1",
+			"com.github.blackhole89.NoteKit.Notebook",
+			"insert_nke",
+			g_variant_new("(@(usay)@(ss))",
+				g_variant_new("(us@ay)", version, "image/svg+xml", svg),
+				g_variant_new("(ss)",
+					APPL_ID,
+					""
+				)
+			),
+			NULL,
+			G_DBUS_CALL_FLAGS_NONE,
+			-1,
+			NULL,
+			(GAsyncReadyCallback) insert_nke_cb,
+			cb_data
+		);
+	}
+}
 
-		g_free(buffer);
+static void pbtn_clicked(GtkButton*, PBtnClickedData* user_data) {
+	if (*user_data->pane_state == PANE_EDIT) {
+		latex_render(user_data, TRUE);
+	} else {
+		if (!*user_data->svg_data)
+			return;
 
-		GVariantBuilder builder;
-		g_variant_builder_init (&builder, G_VARIANT_TYPE("ay"));
-		for (gsize l = 0; l < ret + 4; l++)
-			g_variant_builder_add (&builder, "y", data[l]);
+		ExportData* data = g_new(ExportData, 1);
+		data->pbtn = user_data;
+		data->started = g_get_monotonic_time();
+		data->zstd = g_settings_get_boolean(user_data->settings, "export-zstd");
+		data->handle = g_object_ref(*user_data->svg);
+		data->closing = g_object_ref(user_data->closing);
+		nk_stats_count(NK_COUNTER_EXPORTS);
 
 		GtkTextIter start,end;
 		gtk_text_buffer_get_bounds(GTK_TEXT_BUFFER(user_data->buf), &start, &end);
-		tex = gtk_text_buffer_get_text(GTK_TEXT_BUFFER(user_data->buf), &start, &end, FALSE);
-		
-		if (user_data->args->widget != NULL) {
-			const gchar* filepath;
-			GFile* file;
-
-			filepath = g_variant_get_string(user_data->args->file, NULL);
-			file = g_file_new_for_path(filepath);
+		data->tex = gtk_text_buffer_get_text(GTK_TEXT_BUFFER(user_data->buf), &start, &end, FALSE);
 
-			GError* err = NULL;
-			g_file_replace_contents(file, tex, strlen(tex), NULL, false, G_FILE_CREATE_NONE, NULL, NULL, &err);
-			if (err) {
-				g_critical("failed saving document: %s\n", err->message);
-				g_error_free(err);
-			}
-			g_object_unref(file);
-			//g_free(filepath);
-			g_free(tex);
-
-			g_dbus_connection_call(user_data->con,
-				"com.github.blackhole89.notekit",
-				"/com/github/blackhole89/NoteKit/Notebook/1",
-				"com.github.blackhole89.NoteKit.Notebook",
-				"update_nke",
-				g_variant_new("(@(ss)@(usay))",
-					g_variant_ref(user_data->args->widget),
-					g_variant_new("(usay)", 2, "image/svg+xml", &builder)
-				),
-				NULL,
-				G_DBUS_CALL_FLAGS_NONE,
-				-1,
-				NULL,
-				(GAsyncReadyCallback) sent_msg_cb,
-				NULL
-			);
-		} else {
-			InsertNkeCbData* cb_data = g_new(InsertNkeCbData, 1);
-			cb_data->args = user_data->args;
-			cb_data->data = tex;
-
-			g_dbus_connection_call(user_data->con,
-				"com.github.blackhole89.notekit",
-				"/com/github/blackhole89/NoteKit/Notebook/1",
-				"com.github.blackhole89.NoteKit.Notebook",
-				"insert_nke",
-				g_variant_new("(@(usay)@(ss))",
-					g_variant_new("(usay)", 2, "image/svg+xml", &builder),
-					g_variant_new("(ss)",
-						APPL_ID,
-						""
-					)
-				),
-				NULL,
-				G_DBUS_CALL_FLAGS_NONE,
-				-1,
-				NULL,
-				(GAsyncReadyCallback) insert_nke_cb,
-				cb_data
-			);
-		}
-		g_free(data);
+		nk_export_payload_new_async(*user_data->svg_data,
+			g_settings_get_boolean(user_data->settings, "optimize-svg"),
+			data->zstd,
+			g_settings_get_int(user_data->settings, "export-level"),
+			data->closing, (GAsyncReadyCallback)export_payload_cb, data);
 	}
 }
+#define NK_LIVE_PREVIEW_DELAY 500
+
+static gboolean live_preview_render(PBtnClickedData* user_data) {
+	user_data->live_source = 0;
+	latex_render(user_data, FALSE);
+	return G_SOURCE_REMOVE;
+}
+
+/* A job still running was started from other text, its result must not be
+ * shown as what Export would send. */
+static void latex_input_changed(GtkTextBuffer*, PBtnClickedData* user_data) {
+	if (user_data->cancellable)
+		g_cancellable_cancel(user_data->cancellable);
+	gtk_widget_set_sensitive(GTK_WIDGET(user_data->btn), TRUE);
+	gtk_widget_set_visible(GTK_WIDGET(user_data->res_stack), TRUE);
+}
+
+static void live_preview_schedule(GtkTextBuffer*, PBtnClickedData* user_data) {
+	if (!g_settings_get_boolean(user_data->settings, "live-preview"))
+		return;
+
+	if (user_data->live_source)
+		g_source_remove(user_data->live_source);
+	user_data->live_source = g_timeout_add(NK_LIVE_PREVIEW_DELAY, (GSourceFunc)live_preview_render, user_data);
+}
+
 typedef struct GoEditPaneData {
 	GtkButton* pbtn;
 	AdwLeaflet* leaflet;
@@ -700,18 +4532,70 @@ typedef struct PreferencesWindowData {
 	GtkWindow* parent;
 	GSettings* settings;
 } PreferencesWindowData;
+
+// engine setting <-> row of the engine combo, "auto" comes first
+static gboolean engine_get_mapping(GValue* value, GVariant* variant, gpointer) {
+	const gchar* name = g_variant_get_string(variant, NULL);
+	guint selected = 0;
+	for (guint i = 0; i < NK_N_ENGINES; i++)
+		if (g_str_equal(name, nk_engines[i].name))
+			selected = i + 1;
+	g_value_set_uint(value, selected);
+	return TRUE;
+}
+static GVariant* engine_set_mapping(const GValue* value, const GVariantType*, gpointer) {
+	guint selected = g_value_get_uint(value);
+	if (selected == 0 || selected > NK_N_ENGINES)
+		return g_variant_new_string("auto");
+	return g_variant_new_string(nk_engines[selected - 1].name);
+}
+// export-png-scales <-> comma separated text, "1, 2"
+static gboolean png_scales_get_mapping(GValue* value, GVariant* variant, gpointer) {
+	GString* text = g_string_new("");
+	GVariantIter iter;
+	gint32 scale;
+	g_variant_iter_init(&iter, variant);
+	while (g_variant_iter_next(&iter, "i", &scale))
+		g_string_append_printf(text, "%s%d", text->len ? ", " : "", scale);
+	g_value_take_string(value, g_string_free(text, FALSE));
+	return TRUE;
+}
+static GVariant* png_scales_set_mapping(const GValue* value, const GVariantType*, gpointer) {
+	gchar** parts = g_strsplit_set(g_value_get_string(value), ", ", -1);
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("ai"));
+	for (gchar** part = parts; *part; part++) {
+		gint64 scale;
+		if (**part && g_ascii_string_to_signed(*part, 10, 1, NK_RENDITION_SCALE_MAX, &scale, NULL))
+			g_variant_builder_add(&builder, "i", (gint32)scale);
+	}
+	g_strfreev(parts);
+	return g_variant_builder_end(&builder);
+}
 static void preferences_window(GObject*, GVariant*, PreferencesWindowData* user_data) {
 	GtkBuilder* bld;
-	GtkWidget *win,*tikz,*circuitikz,*chemfig,*mhchem;
+	GtkWidget *win,*engine,*tikz,*circuitikz,*chemfig,*mhchem,*live_preview,*incremental_blocks,*tex_workers,*max_renders,*render_timeout,*render_cpu,*render_memory,*optimize_svg,*export_zstd,*export_level,*export_png_scales;
 	GtkSourceBuffer* preamble;
 	GtkSourceLanguageManager* lm;
 	GtkSourceLanguage* tex;
 	bld = gtk_builder_new_from_resource("/arpa/sp1rit/NoteKit/NkLaTeX/prefs.ui");
 	win = GTK_WIDGET(gtk_builder_get_object(bld, "pref_win"));
+	engine = GTK_WIDGET(gtk_builder_get_object(bld, "engine"));
 	tikz = GTK_WIDGET(gtk_builder_get_object(bld, "pkg_tikz"));
 	circuitikz = GTK_WIDGET(gtk_builder_get_object(bld, "pkg_circuitikz"));
 	chemfig = GTK_WIDGET(gtk_builder_get_object(bld, "pkg_chemfig"));
 	mhchem = GTK_WIDGET(gtk_builder_get_object(bld, "pkg_mhchem"));
+	live_preview = GTK_WIDGET(gtk_builder_get_object(bld, "live_preview"));
+	incremental_blocks = GTK_WIDGET(gtk_builder_get_object(bld, "incremental_blocks"));
+	tex_workers = GTK_WIDGET(gtk_builder_get_object(bld, "tex_workers"));
+	max_renders = GTK_WIDGET(gtk_builder_get_object(bld, "max_renders"));
+	render_timeout = GTK_WIDGET(gtk_builder_get_object(bld, "render_timeout"));
+	render_cpu = GTK_WIDGET(gtk_builder_get_object(bld, "render_cpu"));
+	render_memory = GTK_WIDGET(gtk_builder_get_object(bld, "render_memory"));
+	optimize_svg = GTK_WIDGET(gtk_builder_get_object(bld, "optimize_svg"));
+	export_zstd = GTK_WIDGET(gtk_builder_get_object(bld, "export_zstd"));
+	export_level = GTK_WIDGET(gtk_builder_get_object(bld, "export_level"));
+	export_png_scales = GTK_WIDGET(gtk_builder_get_object(bld, "export_png_scales"));
 	
 	preamble = GTK_SOURCE_BUFFER(gtk_builder_get_object(bld, "preamble"));
 	lm = gtk_source_language_manager_get_default();
@@ -722,10 +4606,24 @@ static void preferences_window(GObject*, GVariant*, PreferencesWindowData* user_
 	gtk_text_buffer_set_text(GTK_TEXT_BUFFER(preamble), preamble_text, -1);
 	g_free(preamble_text);
 
+	g_settings_bind_with_mapping(user_data->settings, "engine", G_OBJECT(engine), "selected", G_SETTINGS_BIND_DEFAULT,
+		engine_get_mapping, engine_set_mapping, NULL, NULL);
 	g_settings_bind(user_data->settings, "pkg-tikz", G_OBJECT(tikz), "active", G_SETTINGS_BIND_DEFAULT);
 	g_settings_bind(user_data->settings, "pkg-circuitikz", G_OBJECT(circuitikz), "active", G_SETTINGS_BIND_DEFAULT);
 	g_settings_bind(user_data->settings, "pkg-chemfig", G_OBJECT(chemfig), "active", G_SETTINGS_BIND_DEFAULT);
 	g_settings_bind(user_data->settings, "pkg-mhchem", G_OBJECT(mhchem), "active", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "live-preview", G_OBJECT(live_preview), "active", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "incremental-blocks", G_OBJECT(incremental_blocks), "active", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "tex-workers", G_OBJECT(tex_workers), "value", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "max-renders", G_OBJECT(max_renders), "value", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "render-timeout", G_OBJECT(render_timeout), "value", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "render-cpu", G_OBJECT(render_cpu), "value", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "render-memory", G_OBJECT(render_memory), "value", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "optimize-svg", G_OBJECT(optimize_svg), "active", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "export-zstd", G_OBJECT(export_zstd), "active", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind(user_data->settings, "export-level", G_OBJECT(export_level), "value", G_SETTINGS_BIND_DEFAULT);
+	g_settings_bind_with_mapping(user_data->settings, "export-png-scales", G_OBJECT(export_png_scales), "text", G_SETTINGS_BIND_DEFAULT,
+		png_scales_get_mapping, png_scales_set_mapping, NULL, NULL);
 	g_signal_connect(preamble, "changed", G_CALLBACK(save_preamble), user_data->settings);
 
 	gtk_window_set_transient_for(GTK_WINDOW(win), user_data->parent);
@@ -753,12 +4651,14 @@ typedef struct DestroyData {
 	NkActivateArgs* args;
 
 	RsvgHandle** svg;
-	int* svg_fd;
+	GBytes** svg_data;
 	guint8* pane_state;
 
 	PBtnClickedData* pbtn_d;
 	GoEditPaneData* epane_d;
 	PreferencesWindowData* pref_d;
+	GtkWidget* view;
+	GCancellable* load;
 } DestroyData;
 
 static void destroy(GtkWidget*, DestroyData* user_data) {
@@ -770,34 +4670,76 @@ static void destroy(GtkWidget*, DestroyData* user_data) {
 
 	g_object_unref(*user_data->svg);
 	g_free(user_data->svg);
-	close(*user_data->svg_fd);
-	g_free(user_data->svg_fd);
+	if (*user_data->svg_data)
+		g_bytes_unref(*user_data->svg_data);
+	g_free(user_data->svg_data);
 	g_free(user_data->pane_state);
 
+	if (user_data->pbtn_d->live_source)
+		g_source_remove(user_data->pbtn_d->live_source);
+	// in-flight jobs see the cancellation and won't touch the freed window
+	if (user_data->pbtn_d->cancellable) {
+		g_cancellable_cancel(user_data->pbtn_d->cancellable);
+		g_object_unref(user_data->pbtn_d->cancellable);
+	}
+	g_cancellable_cancel(user_data->pbtn_d->closing);
+	g_object_unref(user_data->pbtn_d->closing);
 	g_free(user_data->pbtn_d);
 	g_free(user_data->epane_d);
 	g_free(user_data->pref_d);
+	// a source still loading would land in the freed editor otherwise
+	g_cancellable_cancel(user_data->load);
+	g_object_unref(user_data->load);
 
 	g_free(user_data);
 }
 
-static void activate(GtkApplication* app, NkActivateArgs* args) {
+typedef struct LoadSourceData {
+	GtkWidget* view;
+	GtkWidget* pbtn;
+} LoadSourceData;
+static void source_loaded(GObject* src, GAsyncResult* res, LoadSourceData* user_data) {
+	GError* err = NULL;
+	gchar* data;
+	gsize len;
+	if (!g_file_load_contents_finish(G_FILE(src), res, &data, &len, NULL, &err)) {
+		if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_error_free(err);
+			g_free(user_data);
+			return;
+		}
+		g_warning("error loading data: %s\n", err->message);
+		g_error_free(err);
+	} else {
+		gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(user_data->view)), data, len);
+		g_free(data);
+	}
+
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(user_data->view), TRUE);
+	gtk_widget_set_sensitive(user_data->pbtn, TRUE);
+	g_free(user_data);
+}
+
+/* Builds a complete editor window that isn't bound to any widget yet. It
+ * isn't added to app either, so a spare one doesn't keep the service alive. */
+static GtkWidget* nk_window_new(GtkApplication* app) {
 	GtkWidget* window;
 	GtkBuilder* bld;
-	GtkWidget *inner,*pbtn,*bbtn,*leaflet,*cont,*res,*result_stack,*render,*error_view,*error,*spinner;
+	GtkWidget *inner,*pbtn,*bbtn,*leaflet,*cont,*view,*res,*result_stack,*render,*error_view,*error,*spinner;
 	GtkSourceBuffer* buf;
 	GtkSourceLanguageManager* lm;
 	GtkSourceLanguage* tex;
 
 	RsvgHandle** svg = g_new(RsvgHandle*, 1);
-	int* svg_fd = g_new(int, 1);
-	*svg_fd = 0;
+	GBytes** svg_data = g_new(GBytes*, 1);
+	*svg_data = NULL;
 	guint8* pane_state = g_new(guint8, 1);
 	*pane_state = PANE_EDIT;
 
 	*svg = rsvg_handle_new_from_data((guint8*)"<svg></svg>", 13, NULL);
+	NkActivateArgs* args = g_new0(NkActivateArgs, 1);
 	
-	window = adw_application_window_new(app);
+	window = g_object_new(ADW_TYPE_APPLICATION_WINDOW, NULL);
 	gtk_window_set_default_size(GTK_WINDOW(window), 1280, 720);
 	gtk_window_set_title(GTK_WINDOW(window), "NoteKit - LaTeX");
 	if (DEBUG_MODE)
@@ -811,6 +4753,7 @@ static void activate(GtkApplication* app, NkActivateArgs* args) {
 	bbtn = GTK_WIDGET(gtk_builder_get_object(bld, "bbtn"));
 	leaflet = GTK_WIDGET(gtk_builder_get_object(bld, "leaflet"));
 	cont = GTK_WIDGET(gtk_builder_get_object(bld, "scont"));
+	view = GTK_WIDGET(gtk_builder_get_object(bld, "view"));
 	res = GTK_WIDGET(gtk_builder_get_object(bld, "res"));
 	result_stack = GTK_WIDGET(gtk_builder_get_object(bld, "result_stack"));
 	render = GTK_WIDGET(gtk_builder_get_object(bld, "render"));
@@ -822,20 +4765,33 @@ static void activate(GtkApplication* app, NkActivateArgs* args) {
 	lm = gtk_source_language_manager_get_default();
 	tex = gtk_source_language_manager_get_language(lm, "latex");
 	gtk_source_buffer_set_language(buf, tex);
+
+	GtkSourceMarkAttributes* error_attrs = gtk_source_mark_attributes_new();
+	GdkRGBA error_bg = { 1.0, 0.0, 0.0, 0.15 };
+	gtk_source_mark_attributes_set_icon_name(error_attrs, "dialog-error-symbolic");
+	gtk_source_mark_attributes_set_background(error_attrs, &error_bg);
+	g_signal_connect(error_attrs, "query-tooltip-text", G_CALLBACK(latex_error_tooltip), NULL);
+	gtk_source_view_set_mark_attributes(GTK_SOURCE_VIEW(view), NK_ERROR_MARK_CATEGORY, error_attrs, 0);
+	gtk_source_view_set_show_line_marks(GTK_SOURCE_VIEW(view), TRUE);
+	g_object_unref(error_attrs);
 	
 	PBtnClickedData* pbtn_d = g_new(PBtnClickedData, 1);
 	pbtn_d->settings = G_SETTINGS(g_object_get_data(G_OBJECT(app), "settings"));
 	pbtn_d->buf = buf;
 	pbtn_d->leaflet = ADW_LEAFLET(leaflet);
 	pbtn_d->res = res;
-	pbtn_d->svg_fd = svg_fd;
 	pbtn_d->svg = svg;
+	pbtn_d->svg_data = svg_data;
 	pbtn_d->res_stack = GTK_WIDGET(result_stack);
 	pbtn_d->render = NK_LATEX_SVG_AREA(render);
 	pbtn_d->error = GTK_LABEL(error);
 	pbtn_d->pane_state = pane_state;
 	pbtn_d->con = g_application_get_dbus_connection(G_APPLICATION(app));
 	pbtn_d->args = args;
+	pbtn_d->btn = GTK_BUTTON(pbtn);
+	pbtn_d->cancellable = NULL;
+	pbtn_d->closing = g_cancellable_new();
+	pbtn_d->live_source = 0;
 	g_signal_connect(pbtn, "clicked", G_CALLBACK(pbtn_clicked), pbtn_d);
 
 	GoEditPaneData* epane_d = g_new(GoEditPaneData, 1);
@@ -844,6 +4800,8 @@ static void activate(GtkApplication* app, NkActivateArgs* args) {
 	epane_d->pane_state = pane_state;
 	g_signal_connect(bbtn, "clicked", G_CALLBACK(go_edit_pane), epane_d);
 	g_signal_connect(buf, "changed", G_CALLBACK(go_edit_pane), epane_d);
+	g_signal_connect(buf, "changed", G_CALLBACK(latex_input_changed), pbtn_d);
+	g_signal_connect(buf, "changed", G_CALLBACK(live_preview_schedule), pbtn_d);
 
 	g_object_bind_property(G_OBJECT(result_stack), "visible", G_OBJECT(spinner), "visible", G_BINDING_SYNC_CREATE | G_BINDING_INVERT_BOOLEAN);
 	g_object_bind_property(G_OBJECT(result_stack), "visible", G_OBJECT(spinner), "spinning", G_BINDING_SYNC_CREATE | G_BINDING_INVERT_BOOLEAN);
@@ -862,55 +4820,538 @@ static void activate(GtkApplication* app, NkActivateArgs* args) {
 	g_signal_connect(about, "activate", G_CALLBACK(about_window), window);
 	g_action_map_add_action(G_ACTION_MAP(window), G_ACTION(about));
 
-	if (args->file != NULL) {
-		GFile* file = g_file_new_for_path(g_variant_get_string(args->file, NULL));
-		GError* err = NULL;
-		GBytes* data = g_file_load_bytes(file, NULL, NULL, &err);
-		if (err) {
-			g_warning("error loading data: %s\n", err->message);
-			g_error_free(err);
-		} else {
-			gsize len;
-			// TODO: length calculations are wrong on multi-line files
-			gtk_text_buffer_set_text(GTK_TEXT_BUFFER(buf), g_bytes_get_data(data, &len), -1);
-			g_bytes_unref(data);
-		}
-		g_object_unref(file);
-	}
-
 	DestroyData* destroy_d = g_new(DestroyData, 1);
 	destroy_d->args = args;
 	destroy_d->svg = svg;
-	destroy_d->svg_fd = svg_fd;
+	destroy_d->svg_data = svg_data;
 	destroy_d->pane_state = pane_state;
 	destroy_d->pbtn_d = pbtn_d;
 	destroy_d->epane_d = epane_d;
 	destroy_d->pref_d = pref_d;
+	destroy_d->view = view;
+	destroy_d->load = g_cancellable_new();
+	g_object_set_data(G_OBJECT(window), "nk-window", destroy_d);
 	g_signal_connect(window, "destroy", G_CALLBACK(destroy), destroy_d);
 
 	adw_application_window_set_content(ADW_APPLICATION_WINDOW(window), inner);
+	g_object_unref(bld);
+	return window;
+}
+
+/* Activation.
+ *
+ * Building a window (parsing nklatex.ui, setting up the source view, the
+ * first realize of a toplevel) is most of the time between a click in
+ * NoteKit and an editable window. So one window is kept built and hidden,
+ * handed out on activation and replaced once the main loop is idle again.
+ */
+static GtkWidget* nk_spare_window;
+static guint nk_spare_source;
+
+static gboolean nk_spare_window_build(GtkApplication* app) {
+	nk_spare_source = 0;
+	if (!nk_spare_window) {
+		nk_spare_window = nk_window_new(app);
+		gtk_widget_realize(nk_spare_window);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void nk_spare_window_schedule(GtkApplication* app) {
+	if (!nk_spare_source)
+		nk_spare_source = g_idle_add_full(G_PRIORITY_LOW, (GSourceFunc)nk_spare_window_build, app, NULL);
+}
+
+static void activate(GtkApplication* app, GVariant* widget, GVariant* path) {
+	GtkWidget* window = nk_spare_window;
+	nk_spare_window = NULL;
+	if (!window)
+		window = nk_window_new(app);
+	DestroyData* data = g_object_get_data(G_OBJECT(window), "nk-window");
+
+	data->args->widget = widget;
+	data->args->file = path ? g_variant_ref(path) : NULL;
+	if (path) {
+		// the window shows up right away, editing waits for the source
+		gtk_text_view_set_editable(GTK_TEXT_VIEW(data->view), FALSE);
+		gtk_widget_set_sensitive(GTK_WIDGET(data->pbtn_d->btn), FALSE);
+		LoadSourceData* load_d = g_new(LoadSourceData, 1);
+		load_d->view = data->view;
+		load_d->pbtn = GTK_WIDGET(data->pbtn_d->btn);
+		GFile* file = g_file_new_for_path(g_variant_get_string(path, NULL));
+		g_file_load_contents_async(file, data->load, (GAsyncReadyCallback)source_loaded, load_d);
+		g_object_unref(file);
+	}
+
+	gtk_window_set_application(GTK_WINDOW(window), app);
 	gtk_widget_show(window);
+	nk_spare_window_schedule(app);
 }
 
 static void nk_activate(GtkApplication* app, GVariant* widget, GVariant* path, gpointer) {
-	NkActivateArgs* args = g_new(NkActivateArgs, 1);
-	args->file = g_variant_ref(path);
-	args->widget = widget;
-	
-	activate(app, args);
+	activate(app, widget, path);
 }
 
 static void user_activate(GtkApplication* app) {
-	NkActivateArgs* args = g_new(NkActivateArgs, 1);
-	args->file = NULL;
-	args->widget = NULL;
-	activate(app, args);
+	activate(app, NULL, NULL);
+}
+
+static void max_renders_changed(GSettings* settings, const gchar* key, NkRenderScheduler* scheduler) {
+	nk_render_scheduler_set_max(scheduler, g_settings_get_int(settings, key));
+}
+
+static void render_limits_changed(GSettings* settings, const gchar*, gpointer) {
+	nk_tex_limits_load(settings);
+	// warm workers got their rlimits when they were started
+	nk_tex_worker_pool_clear(nk_tex_worker_pool_get_default());
+}
+
+static void app_startup(GApplication* app) {
+	GSettings* settings = G_SETTINGS(g_object_get_data(G_OBJECT(app), "settings"));
+
+	NkRenderScheduler* scheduler = nk_ext_appl_get_scheduler(NOTEKIT_APPLICATION(app));
+	max_renders_changed(settings, "max-renders", scheduler);
+	g_signal_connect(settings, "changed::max-renders", G_CALLBACK(max_renders_changed), scheduler);
+
+	nk_tex_limits_load(settings);
+	g_signal_connect(settings, "changed::render-timeout", G_CALLBACK(render_limits_changed), NULL);
+	g_signal_connect(settings, "changed::render-cpu", G_CALLBACK(render_limits_changed), NULL);
+	g_signal_connect(settings, "changed::render-memory", G_CALLBACK(render_limits_changed), NULL);
+
+	// warm the format cache and workers for the current preamble and keep
+	// them in sync
+	nk_fmt_cache_settings_changed(settings, NULL, NULL);
+	g_signal_connect(settings, "changed", G_CALLBACK(nk_fmt_cache_settings_changed), NULL);
+
+	nk_spare_window_schedule(GTK_APPLICATION(app));
+}
+
+static void app_shutdown(GApplication*) {
+	if (nk_spare_source) {
+		g_source_remove(nk_spare_source);
+		nk_spare_source = 0;
+	}
+	if (nk_spare_window)
+		gtk_window_destroy(GTK_WINDOW(g_steal_pointer(&nk_spare_window)));
+	nk_tex_worker_pool_clear(nk_tex_worker_pool_get_default());
+}
+
+// leak checks fail if the resident set grows by more than this after warm-up
+#define NK_LEAK_CHECK_SLACK (2 << 20)
+// how long the window leak check waits for a render or an export
+#define NK_LEAK_CHECK_WAIT (5 * 60)
+
+static gsize nk_rss(void) {
+	gchar* statm;
+	unsigned long pages = 0;
+	if (g_file_get_contents("/proc/self/statm", &statm, NULL, NULL)) {
+		sscanf(statm, "%*u %lu", &pages);
+		g_free(statm);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Prints how much the resident set grew since baseline over renders and
+ * returns whether that is within NK_LEAK_CHECK_SLACK. */
+static gboolean nk_leak_check_report(gsize baseline, guint renders) {
+	gsize rss = nk_rss();
+	gssize delta = (gssize)rss - (gssize)baseline;
+	g_printerr("resident memory %" G_GSIZE_FORMAT " KiB after warm-up, %" G_GSIZE_FORMAT " KiB at the end: %+" G_GSSIZE_FORMAT " KiB over %u renders, %+" G_GSSIZE_FORMAT " bytes each\n",
+		baseline >> 10, rss >> 10, delta / 1024, renders, renders ? delta / (gssize)renders : 0);
+	return delta <= NK_LEAK_CHECK_SLACK;
+}
+
+/* Leak check through editor windows.
+ *
+ * The batch skips everything interactive. This drives the benchmark inputs
+ * through windows that are built but never shown: typed into the buffer,
+ * rendered by latex_render() via the scheduler and the render cache, once
+ * more from the cache, stacked as blocks and exported to a stand-in NoteKit
+ * on a private D-Bus connection. Inputs are tagged with the round so every
+ * round compiles, caches live in a scratch XDG_CACHE_HOME and the memory
+ * cache is emptied after each round, so a filling cache doesn't look like a
+ * leak.
+ */
+static const gchar nk_fake_notekit_xml[] =
+	"<node>"
+	"<interface name='com.github.blackhole89.NoteKit.Notebook'>"
+	"<method name='insert_nke'><arg type='(usay)' direction='in'/><arg type='(ss)' direction='in'/><arg type='(ss)' direction='out'/></method>"
+	"<method name='update_nke'><arg type='(ss)' direction='in'/><arg type='(usay)' direction='in'/></method>"
+	"<method name='update_nke_edata'><arg type='(ss)' direction='in'/><arg type='s' direction='in'/></method>"
+	"</interface>"
+	"</node>";
+
+typedef struct NkWindowCheck {
+	// what insert_nke places widgets in
+	gchar* note;
+	// the stand-in's end, NULL until it is authenticated
+	GDBusConnection* server;
+	GError* server_error;
+	// exports that reached their last call, update_nke or update_nke_edata
+	guint exported;
+	guint expected;
+} NkWindowCheck;
+
+static void nk_fake_notekit_call(GDBusConnection*, const gchar*, const gchar*, const gchar*, const gchar* method, GVariant*, GDBusMethodInvocation* invoc, NkWindowCheck* check) {
+	if (g_str_equal(method, "insert_nke")) {
+		g_dbus_method_invocation_return_value(invoc, g_variant_new("((ss))", check->note, "leak-check"));
+		return;
+	}
+	check->exported++;
+	g_dbus_method_invocation_return_value(invoc, NULL);
+}
+
+static const GDBusInterfaceVTable nk_fake_notekit_vtable = {
+	.method_call = (GDBusInterfaceMethodCallFunc)nk_fake_notekit_call
+};
+
+static void nk_fake_notekit_accepted(GObject*, GAsyncResult* res, NkWindowCheck* check) {
+	check->server = g_dbus_connection_new_finish(res, &check->server_error);
+}
+
+static gboolean nk_fake_notekit_ready(NkWindowCheck* check) {
+	return check->server || check->server_error;
+}
+
+/* Serves check's stand-in NoteKit on one end of a socket pair and returns
+ * the other end, for NkLaTeX to call. */
+static GDBusConnection* nk_fake_notekit_new(NkWindowCheck* check, GError** err) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+		g_set_error(err, G_IO_ERROR, g_io_error_from_errno(errno), "failed creating socket pair: %s", g_strerror(errno));
+		return NULL;
+	}
+	GSocket* client_socket = g_socket_new_from_fd(fds[0], err);
+	if (!client_socket) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+	GSocket* server_socket = g_socket_new_from_fd(fds[1], err);
+	if (!server_socket) {
+		g_object_unref(client_socket);
+		close(fds[1]);
+		return NULL;
+	}
+	GSocketConnection* client_stream = g_socket_connection_factory_create_connection(client_socket);
+	GSocketConnection* server_stream = g_socket_connection_factory_create_connection(server_socket);
+	g_object_unref(client_socket);
+	g_object_unref(server_socket);
+
+	// the server authenticates in a thread while this one is the client
+	gchar* guid = g_dbus_generate_guid();
+	g_dbus_connection_new(G_IO_STREAM(server_stream), guid, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER, NULL, NULL, (GAsyncReadyCallback)nk_fake_notekit_accepted, check);
+	GDBusConnection* con = g_dbus_connection_new_sync(G_IO_STREAM(client_stream), NULL, G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT, NULL, NULL, err);
+	g_free(guid);
+	g_object_unref(client_stream);
+	g_object_unref(server_stream);
+	nk_wait((NkWaitFunc)nk_fake_notekit_ready, check, NK_LEAK_CHECK_WAIT);
+	if (!con || !check->server) {
+		if (con) {
+			g_propagate_error(err, g_steal_pointer(&check->server_error));
+			g_object_unref(con);
+		}
+		g_clear_error(&check->server_error);
+		return NULL;
+	}
+
+	GDBusNodeInfo* info = g_dbus_node_info_new_for_xml(nk_fake_notekit_xml, NULL);
+	guint registered = g_dbus_connection_register_object(check->server, "/com/github/blackhole89/NoteKit/Notebook/1",
+		info->interfaces[0], &nk_fake_notekit_vtable, check, NULL, err);
+	g_dbus_node_info_unref(info);
+	if (!registered) {
+		g_object_unref(con);
+		return NULL;
+	}
+	return con;
+}
+
+static gboolean nk_window_check_rendered(PBtnClickedData* pbtn_d) {
+	return gtk_widget_get_sensitive(GTK_WIDGET(pbtn_d->btn));
+}
+
+static gboolean nk_window_check_render(PBtnClickedData* pbtn_d, const gchar* input) {
+	gtk_text_buffer_set_text(GTK_TEXT_BUFFER(pbtn_d->buf), input, -1);
+	latex_render(pbtn_d, TRUE);
+	return nk_wait((NkWaitFunc)nk_window_check_rendered, pbtn_d, NK_LEAK_CHECK_WAIT);
+}
+
+static gboolean nk_window_check_exported(NkWindowCheck* check) {
+	return check->exported == check->expected;
+}
+
+static gboolean nk_window_check_export(NkWindowCheck* check, PBtnClickedData* pbtn_d) {
+	// the render failed, nothing to export
+	if (!*pbtn_d->svg_data)
+		return TRUE;
+	check->expected = check->exported + 1;
+	pbtn_clicked(pbtn_d->btn, pbtn_d);
+	return nk_wait((NkWaitFunc)nk_window_check_exported, check, NK_LEAK_CHECK_WAIT);
+}
+
+/* Runs the window leak check on the inputs queued on batch, returns the exit
+ * status. */
+static int nk_window_leak_check(NkBatch* batch, gint rounds) {
+	GError* err = NULL;
+	gchar* scratch = g_dir_make_tmp("nklatex-leak-check-XXXXXX", &err);
+	if (!scratch) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		return EXIT_FAILURE;
+	}
+	// before anything looks the cache directory up
+	gchar* cache = g_build_filename(scratch, "cache", NULL);
+	g_setenv("XDG_CACHE_HOME", cache, TRUE);
+	g_free(cache);
+
+	if (!gtk_init_check()) {
+		g_printerr("no display, skipping the window leak check\n");
+		nk_rm_dir(scratch);
+		g_free(scratch);
+		// meson's skip
+		return 77;
+	}
+	gtk_source_init();
+	g_resources_register(nkl_resource_get_resource());
+
+	GPtrArray* inputs = g_ptr_array_new();
+	for (GList* l = batch->pending.head; l; l = l->next)
+		if (nk_batch_item_load(l->data))
+			g_ptr_array_add(inputs, ((NkBatchItem*)l->data)->input);
+
+	GSettings* settings = batch->settings;
+	g_settings_delay(settings);
+	// renders are started explicitly, stacked inputs go block by block
+	g_settings_set_boolean(settings, "live-preview", FALSE);
+	g_settings_set_boolean(settings, "incremental-blocks", TRUE);
+	g_settings_set_value(settings, "export-png-scales", g_variant_new_parsed("[1]"));
+
+	AdwApplication* app = nk_ext_appl_new();
+	g_application_set_flags(G_APPLICATION(app), G_APPLICATION_NON_UNIQUE);
+	g_object_set_data(G_OBJECT(app), "settings", settings);
+	int status = EXIT_SUCCESS;
+	if (!g_application_register(G_APPLICATION(app), NULL, &err)) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		status = EXIT_FAILURE;
+		goto out;
+	}
+	max_renders_changed(settings, "max-renders", nk_ext_appl_get_scheduler(NOTEKIT_APPLICATION(app)));
+
+	NkWindowCheck check = { .note = g_build_filename(scratch, "notes", "leak-check.md", NULL) };
+	GDBusConnection* con = nk_fake_notekit_new(&check, &err);
+	if (!con) {
+		g_printerr("failed setting up a NoteKit stand-in: %s\n", err->message);
+		g_error_free(err);
+		g_free(check.note);
+		status = EXIT_FAILURE;
+		goto out;
+	}
+
+	gsize baseline = nk_rss();
+	guint renders = 0;
+	for (gint round = 0; round < rounds && status == EXIT_SUCCESS; round++) {
+		GtkWidget* window = nk_window_new(GTK_APPLICATION(app));
+		gtk_window_set_application(GTK_WINDOW(window), GTK_APPLICATION(app));
+		PBtnClickedData* pbtn_d = ((DestroyData*)g_object_get_data(G_OBJECT(window), "nk-window"))->pbtn_d;
+		pbtn_d->con = con;
+
+		for (guint i = 0; i < inputs->len && status == EXIT_SUCCESS; i++) {
+			const gchar* input = g_ptr_array_index(inputs, i);
+			gchar* whole = g_strdup_printf("%s\n%% round %d\n", input, round);
+			gchar* stacked = g_strdup_printf("%s\n%% block %d\n\n%s", input, round, whole);
+			// compiled, from the cache, exported and stacked
+			if (!nk_window_check_render(pbtn_d, whole) || !nk_window_check_render(pbtn_d, whole)
+				|| !nk_window_check_export(&check, pbtn_d) || !nk_window_check_render(pbtn_d, stacked)) {
+				g_printerr("gave up waiting for round %d of input %u\n", round, i);
+				status = EXIT_FAILURE;
+			}
+			g_free(stacked);
+			g_free(whole);
+			if (round > rounds / 10)
+				renders += 3;
+		}
+
+		gtk_window_destroy(GTK_WINDOW(window));
+		nk_render_cache_clear(nk_render_cache_get_default());
+		if (round == rounds / 10)
+			baseline = nk_rss();
+	}
+	if (status == EXIT_SUCCESS && !nk_leak_check_report(baseline, renders))
+		status = EXIT_FAILURE;
+
+	g_object_unref(con);
+	g_object_unref(check.server);
+	g_free(check.note);
+out:
+	nk_tex_worker_pool_clear(nk_tex_worker_pool_get_default());
+	nk_fmt_cache_abort(nk_fmt_cache_get_default());
+	g_object_unref(app);
+	g_settings_revert(settings);
+	g_ptr_array_unref(inputs);
+	nk_rm_dir(scratch);
+	g_free(scratch);
+	return status;
+}
+
+/* Conversions that don't need any UI, handled before GTK gets loaded. */
+static gboolean headless(int* argc, char*** argv, int* status) {
+	gchar** render = NULL;
+	gchar** rerender = NULL;
+	gchar** benchmark = NULL;
+	gchar* output = NULL;
+	gboolean use_stdin = FALSE;
+	gboolean all_packages = FALSE;
+	gint jobs = 0;
+	gint leak_check = 0;
+	gboolean windows = FALSE;
+	const GOptionEntry entries[] = {
+		{ "render", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &render, "Render the LaTeX body in FILE to svg", "FILE" },
+		{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Where to write the svg, - for stdout. A directory if there are several inputs", "PATH" },
+		{ "stdin", 0, 0, G_OPTION_ARG_NONE, &use_stdin, "Render the LaTeX body read from stdin", NULL },
+		{ "rerender", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &rerender, "Re-render all widgets of a note or notebook and send them to NoteKit", "PATH" },
+		{ "benchmark", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &benchmark, "Time each render phase of FILE, or all .tex files in a directory, and print them as JSON lines", "PATH" },
+		{ "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "Number of documents compiled at once, defaults to the number of cores", "N" },
+		{ "all-packages", 0, 0, G_OPTION_ARG_NONE, &all_packages, "Load every optional package instead of only the ones used", NULL },
+		{ "leak-check", 0, 0, G_OPTION_ARG_INT, &leak_check, "Run the benchmark ROUNDS times without output and fail if memory keeps growing", "ROUNDS" },
+		{ "windows", 0, 0, G_OPTION_ARG_NONE, &windows, "Leak check through editor windows, the render cache and exports instead of the batch", NULL },
+		{ NULL }
+	};
+
+	GError* err = NULL;
+	GOptionContext* ctx = g_option_context_new(NULL);
+	// everything else is for GApplication
+	g_option_context_set_ignore_unknown_options(ctx, TRUE);
+	g_option_context_set_help_enabled(ctx, FALSE);
+	g_option_context_add_main_entries(ctx, entries, NULL);
+	gboolean parsed = g_option_context_parse(ctx, argc, argv, &err);
+	g_option_context_free(ctx);
+	if (!parsed) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+		*status = EXIT_FAILURE;
+		return TRUE;
+	}
+	if (!render && !rerender && !benchmark && !use_stdin) {
+		g_free(output);
+		return FALSE;
+	}
+
+	GSettings* settings = g_settings_new(APPL_ID);
+	if (all_packages) {
+		// force them on without touching the stored settings
+		g_settings_delay(settings);
+		for (guint i = 0; i < G_N_ELEMENTS(nk_packages); i++)
+			g_settings_set_boolean(settings, nk_packages[i].setting, TRUE);
+	}
+	// compiles run one at a time unless asked otherwise, so timings don't
+	// fight over cores
+	if (benchmark && !jobs)
+		jobs = 1;
+	NkBatch* batch = nk_batch_new(settings, MAX(jobs, 0));
+	g_object_unref(settings);
+
+	guint inputs = (render ? g_strv_length(render) : 0) + (use_stdin ? 1 : 0);
+	gboolean out_dir = inputs > 1 || (output && g_file_test(output, G_FILE_TEST_IS_DIR));
+	*status = EXIT_SUCCESS;
+
+	if (use_stdin) {
+		GIOChannel* in = g_io_channel_unix_new(STDIN_FILENO);
+		g_io_channel_set_encoding(in, NULL, NULL);
+		gchar* input;
+		if (g_io_channel_read_to_end(in, &input, NULL, &err) != G_IO_STATUS_NORMAL) {
+			g_printerr("failed reading stdin: %s\n", err->message);
+			g_error_free(err);
+			*status = EXIT_FAILURE;
+		} else {
+			gchar* out = out_dir ? g_build_filename(output ? output : ".", "stdin.svg", NULL) : g_strdup(output ? output : "-");
+			nk_batch_add_file(batch, "<stdin>", input, out);
+			g_free(out);
+		}
+		g_io_channel_unref(in);
+	}
+	for (gchar** path = render; path && *path; path++) {
+		gchar* out;
+		if (output && !out_dir) {
+			out = g_strdup(output);
+		} else {
+			gchar* name = g_path_get_basename(*path);
+			if (g_str_has_suffix(name, ".tex"))
+				name[strlen(name) - strlen(".tex")] = 0x0;
+			gchar* svg_name = g_strconcat(name, ".svg", NULL);
+			if (output) {
+				out = g_build_filename(output, svg_name, NULL);
+			} else {
+				gchar* dir = g_path_get_dirname(*path);
+				out = g_build_filename(dir, svg_name, NULL);
+				g_free(dir);
+			}
+			g_free(svg_name);
+			g_free(name);
+		}
+		nk_batch_add_file(batch, *path, NULL, out);
+		g_free(out);
+	}
+	for (gchar** path = rerender; path && *path; path++)
+		nk_batch_add_widgets(batch, *path);
+	for (gchar** path = benchmark; path && *path; path++)
+		nk_batch_add_benchmark(batch, *path);
+
+	if (benchmark && leak_check > 0 && windows) {
+		*status = nk_window_leak_check(batch, leak_check);
+		nk_batch_free(batch);
+		g_strfreev(benchmark);
+		g_strfreev(rerender);
+		g_strfreev(render);
+		g_free(output);
+		return TRUE;
+	}
+
+	batch->quiet = leak_check > 0;
+	guint total = batch->pending.length;
+	guint failed = nk_batch_run(batch, &err);
+	if (err) {
+		g_printerr("%s\n", err->message);
+		g_error_free(err);
+	}
+	if (rerender)
+		g_printerr("re-rendered %u of %u widgets\n", total - failed, total);
+
+	if (benchmark && leak_check > 0) {
+		// the first rounds fill caches and allocator arenas, anything growing
+		// after that is owned by nobody
+		gsize baseline = nk_rss();
+		guint renders = 0;
+		for (gint round = 1; round < leak_check; round++) {
+			for (gchar** path = benchmark; path && *path; path++)
+				nk_batch_add_benchmark(batch, *path);
+			if (round > leak_check / 10)
+				renders += batch->pending.length;
+			failed = nk_batch_run(batch, NULL);
+			if (round == leak_check / 10)
+				baseline = nk_rss();
+		}
+		if (!nk_leak_check_report(baseline, renders))
+			*status = EXIT_FAILURE;
+	}
+	if (failed)
+		*status = EXIT_FAILURE;
+
+	nk_batch_free(batch);
+	g_strfreev(benchmark);
+	g_strfreev(rerender);
+	g_strfreev(render);
+	g_free(output);
+	return TRUE;
 }
 
 int main(int argc, char** argv) {
 	AdwApplication* app;
 	GSettings* settings;
 	int status;
+
+	if (headless(&argc, &argv, &status))
+		return status;
 	
 	gtk_source_init();
 	g_resources_register(nkl_resource_get_resource());
@@ -919,6 +5360,8 @@ int main(int argc, char** argv) {
 	settings = g_settings_new(APPL_ID);
 	g_object_set_data(G_OBJECT(app), "settings", settings);
 
+	g_signal_connect(app, "startup", G_CALLBACK(app_startup), NULL);
+	g_signal_connect(app, "shutdown", G_CALLBACK(app_shutdown), NULL);
 	g_signal_connect(app, "activate", G_CALLBACK(user_activate), NULL);
 	g_signal_connect(app, "eactivate", G_CALLBACK(nk_activate), NULL);
 